@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <enet/enet.h>
+
+#include "../common/bams.h"
+#include "../common/types.h"
+#include "../common/packet.h"
+
+/* Packet codec and transport option microbenchmark.
+ *
+ * For every packet type reports bytes on the wire and ns/op for
+ * encoding, decoding and dispatching by id, and what enet_crc32 and
+ * the range coder (both enabled by initEnet) cost and save on top.
+ *
+ * Iterations can be set with SRVBIRTH_BENCH_ITERATIONS environment variable. */
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+
+/* entries in the large snapshot case */
+#define BENCH_SNAPSHOT_ENTRIES 32
+
+/* largest encoded packet */
+#define BENCH_MAX_PACKET (sizeof(PacketServerSnapshot) + BENCH_SNAPSHOT_ENTRIES * PACKET_SNAPSHOT_ACTOR_SIZE)
+
+/* enet protocol header with sent time, and the send command in front of
+ * the payload. Compression covers the commands, the header stays plain. */
+#define BENCH_ENET_HEADER 4
+#define BENCH_ENET_RELIABLE 6
+#define BENCH_ENET_UNRELIABLE 8
+#define BENCH_ENET_CHECKSUM 4
+
+/* udp over ipv4 */
+#define BENCH_UDP_HEADER 28
+
+typedef struct BenchCase {
+   const char *name;
+   unsigned int command; /* BENCH_ENET_RELIABLE or BENCH_ENET_UNRELIABLE */
+   size_t (*encode)(unsigned char *out);
+   int (*decode)(const unsigned char *data, size_t size);
+} BenchCase;
+
+typedef struct BenchResult {
+   size_t payload, wire, wireChecksum, wireCompressed;
+   double encode, decode, dispatch, checksum, compress, decompress; /* ns/op */
+} BenchResult;
+
+static volatile unsigned int sink;
+static const Vector3fQuantization world = WORLD_QUANTIZATION;
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fillActor(PacketSnapshotActor *actor, unsigned int i, unsigned char mask)
+{
+   memset(actor, 0, sizeof(PacketSnapshotActor));
+   actor->clientId = 0x9e3779b9u * (i + 1);
+   actor->base = (mask == SNAPSHOT_ALL ? 0 : 1);
+   actor->mask = mask;
+   actor->flags = ACTOR_FORWARD | ACTOR_ATTACK;
+   actor->rotation = i * 37;
+   actor->position.x = world.x.min + (i * 31) % (int)(world.x.max - world.x.min);
+   actor->position.y = 0.0f;
+   actor->position.z = world.z.min + (i * 17) % (int)(world.z.max - world.z.min);
+}
+
+/* encoders, same as what client and server put on the wire */
+
+/* full history of inputs, as the client sends while moving */
+static size_t encodeActorState(unsigned char *out)
+{
+   unsigned int i;
+   PacketActorState *p = (PacketActorState*)out;
+   ActorInput *inputs = (ActorInput*)(out + sizeof(PacketActorState));
+   p->id = PACKET_ID_ACTOR_STATE;
+   p->count = ACTOR_INPUT_REDUNDANCY;
+   for (i = 0; i != ACTOR_INPUT_REDUNDANCY; ++i) {
+      inputs[i].flags = ACTOR_FORWARD | ACTOR_ATTACK;
+      inputs[i].rotation = (sink + i) & 0xff;
+      inputs[i].sequence = htons((sink - i * 3) & 0xffff);
+   }
+   return sizeof(PacketActorState) + ACTOR_INPUT_REDUNDANCY * sizeof(ActorInput);
+}
+
+static size_t encodeActorFullState(unsigned char *out)
+{
+   BitStream stream;
+   PacketActorFullState p;
+   memset(&p, 0, sizeof(PacketActorFullState));
+   p.id = PACKET_ID_ACTOR_FULL_STATE;
+   p.flags = ACTOR_FORWARD | ACTOR_ATTACK;
+   p.rotation = sink & 0xff;
+   p.position.x = 123.25f;
+   p.position.z = -77.5f;
+   out[0] = p.id;
+   bitStreamInit(&stream, out + sizeof(PacketGeneric), PACKET_ACTOR_FULL_STATE_SIZE);
+   packetWriteActorFullState(&stream, &p);
+   return sizeof(PacketGeneric) + bitStreamBytes(&stream);
+}
+
+static size_t encodeServerActorFullState(unsigned char *out)
+{
+   PacketServerGeneric *header = (PacketServerGeneric*)out;
+   header->clientId = htonl(0x9e3779b9u);
+   header->id = PACKET_ID_ACTOR_FULL_STATE;
+   return sizeof(PacketServerGeneric) - sizeof(PacketGeneric) + encodeActorFullState(out + sizeof(PacketServerGeneric) - sizeof(PacketGeneric));
+}
+
+static size_t encodeRoster(unsigned char *out, unsigned int enter, unsigned int leave)
+{
+   unsigned int i, id;
+   PacketServerRoster *p = (PacketServerRoster*)out;
+   memset(p, 0, sizeof(PacketServerRoster));
+   p->id = PACKET_ID_ROSTER;
+   p->enter = htons(enter);
+   p->leave = htons(leave);
+   for (i = 0; i != enter + leave; ++i) {
+      id = htonl(0x9e3779b9u * (i + 1));
+      memcpy(out + sizeof(PacketServerRoster) + i * sizeof(unsigned int), &id, sizeof(unsigned int));
+   }
+   return sizeof(PacketServerRoster) + (enter + leave) * sizeof(unsigned int);
+}
+
+static size_t encodeRosterJoin(unsigned char *out)
+{
+   return encodeRoster(out, 1, 0);
+}
+
+/* newcomer in a crowd */
+static size_t encodeRosterCrowd(unsigned char *out)
+{
+   return encodeRoster(out, BENCH_SNAPSHOT_ENTRIES, 0);
+}
+
+static size_t encodeSnapshot(unsigned char *out, unsigned int count, unsigned char mask)
+{
+   unsigned int i;
+   BitStream stream;
+   PacketSnapshotActor actor;
+   PacketServerSnapshot *p = (PacketServerSnapshot*)out;
+
+   memset(p, 0, sizeof(PacketServerSnapshot));
+   p->id = PACKET_ID_SNAPSHOT;
+   p->tick = htonl(1000 + (sink & 0xff));
+   p->time = htonl(33 * (1000 + (sink & 0xff)));
+   p->count = count;
+
+   bitStreamInit(&stream, out + sizeof(PacketServerSnapshot), count * PACKET_SNAPSHOT_ACTOR_SIZE);
+   for (i = 0; i != count; ++i) {
+      fillActor(&actor, i, mask);
+      packetWriteSnapshotActor(&stream, &actor);
+   }
+   return sizeof(PacketServerSnapshot) + bitStreamBytes(&stream);
+}
+
+static size_t encodeSnapshotFull(unsigned char *out)
+{
+   return encodeSnapshot(out, 1, SNAPSHOT_ALL);
+}
+
+static size_t encodeSnapshotDelta(unsigned char *out)
+{
+   /* typical moving actor, rotation and ground plane changed */
+   return encodeSnapshot(out, BENCH_SNAPSHOT_ENTRIES, SNAPSHOT_ROTATION | SNAPSHOT_POSITION_X | SNAPSHOT_POSITION_Z);
+}
+
+static size_t encodeActorCorrection(unsigned char *out)
+{
+   BitStream stream;
+   PacketServerActorCorrection p;
+   PacketServerGeneric *header = (PacketServerGeneric*)out;
+
+   memset(&p, 0, sizeof(PacketServerActorCorrection));
+   p.sequence = sink & 0xffff;
+   p.flags = ACTOR_FORWARD;
+   p.rotation = sink & 0xff;
+   p.position.x = 123.25f;
+   p.position.y = 4.5f;
+   p.position.z = -77.5f;
+   p.fallingSpeed = 0.25f;
+
+   header->clientId = htonl(0x9e3779b9u);
+   header->id = PACKET_ID_ACTOR_CORRECTION;
+   bitStreamInit(&stream, out + sizeof(PacketServerGeneric), PACKET_ACTOR_CORRECTION_SIZE);
+   packetWriteActorCorrection(&stream, &p);
+   return sizeof(PacketServerGeneric) + bitStreamBytes(&stream);
+}
+
+static size_t encodeSnapshotAck(unsigned char *out)
+{
+   PacketSnapshotAck *p = (PacketSnapshotAck*)out;
+   p->id = PACKET_ID_SNAPSHOT_ACK;
+   p->tick = htonl(1000 + (sink & 0xff));
+   return sizeof(PacketSnapshotAck);
+}
+
+/* decoders, same checks as the handlers do */
+
+static int decodeActorState(const unsigned char *data, size_t size)
+{
+   unsigned int i;
+   const PacketActorState *p = (const PacketActorState*)data;
+   const ActorInput *inputs = (const ActorInput*)(data + sizeof(PacketActorState));
+   if (size < sizeof(PacketActorState) || size < sizeof(PacketActorState) + p->count * sizeof(ActorInput)) return RETURN_FAIL;
+   for (i = p->count; i > 0; --i)
+      sink += inputs[i - 1].flags + inputs[i - 1].rotation + ntohs(inputs[i - 1].sequence);
+   return RETURN_OK;
+}
+
+static int decodeActorFullState(const unsigned char *data, size_t size)
+{
+   BitStream stream;
+   PacketActorFullState p;
+   bitStreamInit(&stream, (unsigned char*)data + sizeof(PacketGeneric), size - sizeof(PacketGeneric));
+   if (packetReadActorFullState(&stream, &p) != RETURN_OK) return RETURN_FAIL;
+   sink += p.flags + p.rotation + (unsigned int)p.position.x;
+   return RETURN_OK;
+}
+
+static int decodeServerActorFullState(const unsigned char *data, size_t size)
+{
+   const size_t skip = sizeof(PacketServerGeneric) - sizeof(PacketGeneric);
+   if (size < sizeof(PacketServerGeneric)) return RETURN_FAIL;
+   sink += ntohl(((const PacketServerGeneric*)data)->clientId);
+   return decodeActorFullState(data + skip, size - skip);
+}
+
+static int decodeRoster(const unsigned char *data, size_t size)
+{
+   unsigned int i, count, id;
+   const PacketServerRoster *p = (const PacketServerRoster*)data;
+   if (size < sizeof(PacketServerRoster)) return RETURN_FAIL;
+   count = ntohs(p->enter) + ntohs(p->leave);
+   if (size < sizeof(PacketServerRoster) + count * sizeof(unsigned int)) return RETURN_FAIL;
+   for (i = 0; i != count; ++i) {
+      memcpy(&id, data + sizeof(PacketServerRoster) + i * sizeof(unsigned int), sizeof(unsigned int));
+      sink += ntohl(id);
+   }
+   return RETURN_OK;
+}
+
+static int decodeSnapshot(const unsigned char *data, size_t size)
+{
+   unsigned int i;
+   BitStream stream;
+   PacketSnapshotActor actor;
+   const PacketServerSnapshot *p = (const PacketServerSnapshot*)data;
+
+   if (size < sizeof(PacketServerSnapshot)) return RETURN_FAIL;
+   bitStreamInit(&stream, (unsigned char*)data + sizeof(PacketServerSnapshot), size - sizeof(PacketServerSnapshot));
+   for (i = 0; i != p->count; ++i) {
+      if (packetReadSnapshotActor(&stream, &actor) != RETURN_OK) return RETURN_FAIL;
+      sink += actor.clientId + actor.mask;
+   }
+   sink += ntohl(p->tick);
+   return RETURN_OK;
+}
+
+static int decodeActorCorrection(const unsigned char *data, size_t size)
+{
+   BitStream stream;
+   PacketServerActorCorrection p;
+   if (size < sizeof(PacketServerGeneric)) return RETURN_FAIL;
+   bitStreamInit(&stream, (unsigned char*)data + sizeof(PacketServerGeneric), size - sizeof(PacketServerGeneric));
+   if (packetReadActorCorrection(&stream, &p) != RETURN_OK) return RETURN_FAIL;
+   sink += p.sequence + (unsigned int)p.position.x;
+   return RETURN_OK;
+}
+
+static int decodeSnapshotAck(const unsigned char *data, size_t size)
+{
+   if (size < sizeof(PacketSnapshotAck)) return RETURN_FAIL;
+   sink += ntohl(((const PacketSnapshotAck*)data)->tick);
+   return RETURN_OK;
+}
+
+/* peek the id and hand to the decoder, like manageEnet does.
+ * server packets carry the id after clientId. */
+static int dispatch(const unsigned char *data, size_t size, int server)
+{
+   const unsigned char id = (server ? ((const PacketServerGeneric*)data)->id : data[0]);
+   switch (id) {
+      case PACKET_ID_ROSTER: return decodeRoster(data, size);
+      case PACKET_ID_ACTOR_STATE: return decodeActorState(data, size);
+      case PACKET_ID_ACTOR_FULL_STATE: return (server ? decodeServerActorFullState(data, size) : decodeActorFullState(data, size));
+      case PACKET_ID_SNAPSHOT: return decodeSnapshot(data, size);
+      case PACKET_ID_SNAPSHOT_ACK: return decodeSnapshotAck(data, size);
+      case PACKET_ID_ACTOR_CORRECTION: return decodeActorCorrection(data, size);
+   }
+   return RETURN_FAIL;
+}
+
+static const BenchCase cases[] = {
+   { "ActorState",               BENCH_ENET_UNRELIABLE, encodeActorState,           decodeActorState },
+   { "ActorFullState",           BENCH_ENET_UNRELIABLE, encodeActorFullState,       decodeActorFullState },
+   { "ServerActorFullState",     BENCH_ENET_UNRELIABLE, encodeServerActorFullState, decodeServerActorFullState },
+   { "ServerRoster (1 enter)",   BENCH_ENET_RELIABLE,   encodeRosterJoin,           decodeRoster },
+   { "ServerRoster (32 enter)",  BENCH_ENET_RELIABLE,   encodeRosterCrowd,          decodeRoster },
+   { "ServerSnapshot (1 full)",  BENCH_ENET_UNRELIABLE, encodeSnapshotFull,         decodeSnapshot },
+   { "ServerSnapshot (32 delta)",BENCH_ENET_UNRELIABLE, encodeSnapshotDelta,        decodeSnapshot },
+   { "ServerActorCorrection",    BENCH_ENET_UNRELIABLE, encodeActorCorrection,      decodeActorCorrection },
+   { "SnapshotAck",              BENCH_ENET_UNRELIABLE, encodeSnapshotAck,          decodeSnapshotAck },
+};
+
+static int isServerCase(const BenchCase *bench)
+{
+   return !strncmp(bench->name, "Server", 6);
+}
+
+static void runCase(const BenchCase *bench, void *coder, unsigned int iterations, BenchResult *result)
+{
+   unsigned int i;
+   double start;
+   size_t size, compressed = 0;
+   unsigned char command[BENCH_ENET_UNRELIABLE];
+   unsigned char packet[BENCH_MAX_PACKET], out[BENCH_MAX_PACKET * 2], back[BENCH_MAX_PACKET * 2];
+   ENetBuffer buffers[2];
+   const int server = isServerCase(bench);
+
+   memset(result, 0, sizeof(BenchResult));
+   memset(packet, 0, sizeof(packet));
+   memset(command, 0, sizeof(command));
+   command[0] = 0x86; /* send command with some sequence bytes, as enet would */
+   command[2] = 0x12;
+
+   start = now();
+   for (i = 0; i != iterations; ++i) {
+      sink += i;
+      size = bench->encode(packet);
+   }
+   result->encode = (now() - start) / iterations;
+
+   start = now();
+   for (i = 0; i != iterations; ++i)
+      if (bench->decode(packet, size) != RETURN_OK) abort();
+   result->decode = (now() - start) / iterations;
+
+   start = now();
+   for (i = 0; i != iterations; ++i)
+      if (dispatch(packet, size, server) != RETURN_OK) abort();
+   result->dispatch = (now() - start) / iterations;
+
+   /* what enet puts in one datagram for this packet */
+   buffers[0].data = command;
+   buffers[0].dataLength = bench->command;
+   buffers[1].data = packet;
+   buffers[1].dataLength = size;
+
+   start = now();
+   for (i = 0; i != iterations; ++i)
+      sink += enet_crc32(buffers, 2);
+   result->checksum = (now() - start) / iterations;
+
+   start = now();
+   for (i = 0; i != iterations; ++i)
+      compressed = enet_range_coder_compress(coder, buffers, 2, bench->command + size, out, sizeof(out));
+   result->compress = (now() - start) / iterations;
+
+   /* enet sends uncompressed when the coder doesn't win */
+   if (compressed && compressed < bench->command + size) {
+      start = now();
+      for (i = 0; i != iterations; ++i)
+         sink += enet_range_coder_decompress(coder, out, compressed, back, sizeof(back));
+      result->decompress = (now() - start) / iterations;
+   } else {
+      compressed = bench->command + size;
+   }
+
+   result->payload = size;
+   result->wire = BENCH_UDP_HEADER + BENCH_ENET_HEADER + bench->command + size;
+   result->wireChecksum = result->wire + BENCH_ENET_CHECKSUM;
+   result->wireCompressed = BENCH_UDP_HEADER + BENCH_ENET_HEADER + compressed;
+}
+
+int main(void)
+{
+   unsigned int i, iterations = BENCH_DEFAULT_ITERATIONS;
+   const char *env;
+   void *coder;
+   BenchResult r;
+
+   if ((env = getenv("SRVBIRTH_BENCH_ITERATIONS")) && atoi(env) > 0)
+      iterations = atoi(env);
+
+   if (enet_initialize() != 0) {
+      fprintf(stderr, "An error occurred while initializing ENet.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (!(coder = enet_range_coder_create())) {
+      fprintf(stderr, "Failed to create range coder.\n");
+      enet_deinitialize();
+      return EXIT_FAILURE;
+   }
+
+   printf("%u iterations, wire bytes include udp/ipv4 and enet headers\n\n", iterations);
+   printf("%-26s %7s %5s %5s %5s %5s | %8s %8s %8s | %8s %8s %8s\n",
+         "packet", "payload", "wire", "+crc", "+rc", "+both",
+         "enc ns", "dec ns", "disp ns", "crc ns", "rc ns", "unrc ns");
+
+   for (i = 0; i != sizeof(cases) / sizeof(cases[0]); ++i) {
+      runCase(&cases[i], coder, iterations, &r);
+      printf("%-26s %7zu %5zu %5zu %5zu %5zu | %8.1f %8.1f %8.1f | %8.1f %8.1f %8.1f\n",
+            cases[i].name, r.payload, r.wire, r.wireChecksum, r.wireCompressed, r.wireCompressed + BENCH_ENET_CHECKSUM,
+            r.encode, r.decode, r.dispatch, r.checksum, r.compress, r.decompress);
+   }
+
+   enet_range_coder_destroy(coder);
+   enet_deinitialize();
+   return EXIT_SUCCESS;
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -8,6 +8,9 @@
 
 #include "bams.h"
 #include "types.h"
+#include "packet.h"
+#include "log.h"
+#include "sim.h"
 
 #include <float.h>
 
@@ -872,7 +875,7 @@ typedef struct GameActor {
    float speed;
    float fallingSpeed;
    float toRotation;
-   float lastActTime;
+   unsigned char toBams; /* toRotation as sent, what the simulation steps with */
    float swordY;
    char swordD;
    glhckObject *object;
@@ -893,11 +896,41 @@ typedef struct GameCamera {
    unsigned char flags, lastFlags;
 } GameCamera;
 
+/* actor state as reconstructed from snapshots */
+typedef struct ActorSnapshot {
+   unsigned int tick;
+   unsigned int time; /* server milliseconds */
+   unsigned char flags, rotation;
+   Vector3f position;
+} ActorSnapshot;
+
+/* remote actor states buffered for playback */
+#define CLIENT_JITTER_SIZE 32
+
+/* longest we extrapolate past the newest state, in milliseconds */
+#define CLIENT_EXTRAPOLATE_MAX 250.0
+
+/* upper bound of the playout delay, in milliseconds */
+#define CLIENT_DELAY_MAX 500.0
+
+/* maps local time to server time, remote actors are shown
+ * delay milliseconds in the past so there is something to interpolate */
+typedef struct PlayoutClock {
+   int valid;
+   unsigned int lastTime; /* newest server time seen */
+   double offset;   /* server - local, smoothed */
+   double jitter;   /* mean deviation from offset */
+   double interval; /* between snapshots, smoothed */
+   double delay;
+} PlayoutClock;
+
 typedef struct Client {
    GameActor actor;
    unsigned int clientId;
-   char host[45];
-   struct Client *next;
+   ActorSnapshot snapshots[SNAPSHOT_HISTORY]; /* delta baselines, indexed by tick */
+   ActorSnapshot buffer[CLIENT_JITTER_SIZE]; /* for playback, oldest first */
+   unsigned int buffered;
+   struct Client *next, *prev;
 } Client;
 
 typedef struct ClientMaterials {
@@ -906,13 +939,58 @@ typedef struct ClientMaterials {
    glhckMaterial *wall;
 } ClientMaterials;
 
+/* slots in the clientId -> Client map, power of two well above
+ * the actors a server can have so probes stay short */
+#define CLIENT_MAP_SIZE 4096
+
+/* Client records allocated at once when the pool runs dry */
+#define CLIENT_POOL_CHUNK 32
+
+/* input packets per second,
+ * override with SRVBIRTH_INPUT_RATE environment variable */
+#define CLIENT_DEFAULT_INPUT_RATE SIM_TICKRATE
+
+/* once the redundant copies are out, resend the newest input
+ * every this many input packets in case all of them got lost */
+#define CLIENT_INPUT_KEEPALIVE 8
+
+/* simulation steps of our actor kept for replaying */
+#define CLIENT_PREDICTION_SIZE 128
+
+/* distance to the server's position we accept without correcting,
+ * a bit over what the wire quantization can be off by */
+#define CLIENT_CORRECTION_TOLERANCE 0.25f
+
+/* input and resulting state of one predicted step */
+typedef struct PredictedStep {
+   unsigned short sequence;
+   unsigned char flags, rotation;
+   SimState state;
+} PredictedStep;
+
 typedef struct ClientData {
    GameCamera camera;
    float delta;
+   float simTime; /* seconds not simulated yet */
+   PlayoutClock playout;
+   double renderTime; /* server time remote actors are shown at */
+   unsigned int simSteps; /* fixed steps to simulate this frame */
+   unsigned short sequence; /* our last simulated step */
+   unsigned short inputSequence; /* step current input was first used on */
+   unsigned short corrected; /* sequence of the last correction */
+   ActorInput inputs[ACTOR_INPUT_REDUNDANCY]; /* last inputs, newest first, host order */
+   unsigned int numInputs;
+   unsigned int inputRepeats; /* times the newest input was sent */
+   float inputInterval, inputTime; /* seconds */
+   int hasCorrection;
+   PredictedStep predictions[CLIENT_PREDICTION_SIZE];
    ENetHost *client;
    ENetPeer *peer;
    Client *me;
    Client *clients;
+   Client *freeClients; /* pool, linked by next */
+   Client *clientMap[CLIENT_MAP_SIZE]; /* open addressing, linear probing */
+   unsigned int numClients;
    ClientMaterials materials;
 } ClientData;
 
@@ -942,46 +1020,133 @@ static void resizeCallback(GLFWwindow* window, int width, int height)
    glhckDisplayResize(width, height);
 }
 
+static unsigned int clientMapHash(unsigned int id)
+{
+   /* connect ids are random but don't trust the low bits */
+   id ^= id >> 16;
+   id *= 0x45d9f3b;
+   id ^= id >> 16;
+   return id & (CLIENT_MAP_SIZE - 1);
+}
+
+static int clientMapInsert(ClientData *data, Client *client)
+{
+   unsigned int i;
+
+   if (data->numClients >= CLIENT_MAP_SIZE / 2)
+      return RETURN_FAIL;
+
+   for (i = clientMapHash(client->clientId); data->clientMap[i]; i = (i + 1) & (CLIENT_MAP_SIZE - 1));
+   data->clientMap[i] = client;
+   data->numClients++;
+   return RETURN_OK;
+}
+
+static void clientMapRemove(ClientData *data, Client *client)
+{
+   unsigned int i, j, home;
+
+   for (i = clientMapHash(client->clientId); data->clientMap[i] && data->clientMap[i] != client;
+        i = (i + 1) & (CLIENT_MAP_SIZE - 1));
+   if (!data->clientMap[i])
+      return;
+
+   /* shift back entries whose probe went past the hole */
+   for (j = (i + 1) & (CLIENT_MAP_SIZE - 1); data->clientMap[j]; j = (j + 1) & (CLIENT_MAP_SIZE - 1)) {
+      home = clientMapHash(data->clientMap[j]->clientId);
+      if (((j - home) & (CLIENT_MAP_SIZE - 1)) < ((j - i) & (CLIENT_MAP_SIZE - 1)))
+         continue;
+      data->clientMap[i] = data->clientMap[j];
+      i = j;
+   }
+   data->clientMap[i] = NULL;
+   data->numClients--;
+}
+
+static Client* gameAllocClient(ClientData *data)
+{
+   unsigned int i;
+   Client *c;
+
+   if (!data->freeClients) {
+      if (!(c = malloc(CLIENT_POOL_CHUNK * sizeof(Client))))
+         return NULL;
+      for (i = 0; i != CLIENT_POOL_CHUNK; ++i) {
+         c[i].next = data->freeClients;
+         data->freeClients = &c[i];
+      }
+   }
+
+   c = data->freeClients;
+   data->freeClients = c->next;
+   return c;
+}
+
 static Client* gameNewClient(ClientData *data, Client *params)
 {
    Client *c;
 
-   /* add to list */
-   for (c = data->clients; c && c->next; c = c->next);
-   if (c) c = c->next = malloc(sizeof(Client));
-   else c = data->clients = malloc(sizeof(Client));
+   if (!(c = gameAllocClient(data)))
+      return NULL;
 
    memcpy(c, params, sizeof(Client));
+   if (clientMapInsert(data, c) != RETURN_OK) {
+      c->next = data->freeClients;
+      data->freeClients = c;
+      return NULL;
+   }
+
+   /* add to list */
+   c->prev = NULL;
+   c->next = data->clients;
+   if (data->clients) data->clients->prev = c;
+   data->clients = c;
    return c;
 }
 
 static void gameFreeClient(ClientData *data, Client *client)
 {
-   Client *c;
-
    /* remove from list */
-   for (c = data->clients; c != client && c->next != client; c = c->next);
-   if (c == client) data->clients = client->next;
-   else if (c) c->next = client->next;
+   if (client->prev) client->prev->next = client->next;
+   else data->clients = client->next;
+   if (client->next) client->next->prev = client->prev;
+
+   clientMapRemove(data, client);
 
-   free(client);
+   /* back to pool, chunks live as long as the game */
+   client->next = data->freeClients;
+   data->freeClients = client;
+}
+
+static void gameClientSetId(ClientData *data, Client *client, unsigned int id)
+{
+   clientMapRemove(data, client);
+   client->clientId = id;
+   clientMapInsert(data, client);
 }
 
 static Client* clientForId(ClientData *data, unsigned int id)
 {
+   unsigned int i;
    Client *c;
-   for (c = data->clients; c && c->clientId != id; c = c->next);
-   printf("%s %u\n", c?"Found id":"Did not found id", id);
+
+   for (i = clientMapHash(id); (c = data->clientMap[i]) && c->clientId != id; i = (i + 1) & (CLIENT_MAP_SIZE - 1));
    return c;
 }
 
 static void initClientData(ClientData *data)
 {
+   const char *rate;
    Client client;
    assert(data);
    memset(data, 0, sizeof(ClientData));
    memset(&client, 0, sizeof(Client));
    data->me = gameNewClient(data, &client);
+
+   if (!(rate = getenv("SRVBIRTH_INPUT_RATE")) || atoi(rate) <= 0)
+      data->inputInterval = 1.0f / CLIENT_DEFAULT_INPUT_RATE;
+   else
+      data->inputInterval = 1.0f / atoi(rate);
 }
 
 static void gameSend(ClientData *data, unsigned char *pdata, size_t size, ENetPacketFlag flag)
@@ -989,7 +1154,7 @@ static void gameSend(ClientData *data, unsigned char *pdata, size_t size, ENetPa
    ENetPacket *packet;
    PacketGeneric *generic = (PacketGeneric*)pdata;
    packet = enet_packet_create(pdata, size, flag);
-   enet_peer_send(data->peer, 0, packet);
+   enet_peer_send(data->peer, (flag & ENET_PACKET_FLAG_RELIABLE ? CHANNEL_CONTROL : CHANNEL_STATE), packet);
 }
 
 static int initEnet(const char *host_ip, const int host_port, ClientData *data)
@@ -999,19 +1164,18 @@ static int initEnet(const char *host_ip, const int host_port, ClientData *data)
    assert(host_ip && data && data->me);
 
    if (enet_initialize() != 0) {
-      fprintf (stderr, "An error occurred while initializing ENet.\n");
+      LOG_E("An error occurred while initializing ENet.");
       return RETURN_FAIL;
    }
 
    data->client = enet_host_create(NULL,
          1     /* 1 outgoing connection */,
-         2     /* max channels */,
+         CHANNEL_COUNT /* max channels */,
          0     /* download bandwidth */,
          0     /* upload bandwidth */);
 
    if (!data->client) {
-      fprintf (stderr,
-            "An error occurred while trying to create an ENet client host.\n");
+      LOG_E("An error occurred while trying to create an ENet client host.");
       return RETURN_FAIL;
    }
 
@@ -1023,12 +1187,11 @@ static int initEnet(const char *host_ip, const int host_port, ClientData *data)
    enet_address_set_host(&address, host_ip);
    address.port = host_port;
 
-   /* Initiate the connection, allocating the two channels 0 and 1. */
-   data->peer = enet_host_connect(data->client, &address, 2, 0);
+   /* Initiate the connection, allocating control and state channels. */
+   data->peer = enet_host_connect(data->client, &address, CHANNEL_COUNT, 0);
 
    if (!data->peer) {
-      fprintf (stderr,
-            "No available peers for initiating an ENet connection.\n");
+      LOG_E("No available peers for initiating an ENet connection.");
       return RETURN_FAIL;;
    }
 
@@ -1036,22 +1199,19 @@ static int initEnet(const char *host_ip, const int host_port, ClientData *data)
    if (enet_host_service(data->client, &event, 5000) > 0 &&
          event.type == ENET_EVENT_TYPE_CONNECT)
    {
-      fprintf(stderr,
-            "Connection to %s:%d succeeded.\n", host_ip, host_port);
+      LOG_I("Connection to %s:%d succeeded.", host_ip, host_port);
    } else {
       /* Either the 5 seconds are up or a disconnect event was */
       /* received. Reset the peer in the event the 5 seconds   */
       /* had run out without any significant event.            */
       enet_peer_reset(data->peer);
-      fprintf(stderr,
-            "Connection to %s:%d failed.\n", host_ip, host_port);
+      LOG_E("Connection to %s:%d failed.", host_ip, host_port);
       return RETURN_FAIL;
    }
 
    /* store our client id */
-   data->me->clientId = data->peer->connectID;
-   strncpy(data->me->host, "127.0.0.1", sizeof(data->me->host));
-   printf("My ID is %u\n", data->me->clientId);
+   gameClientSetId(data, data->me, data->peer->connectID);
+   LOG_I("My ID is %u", data->me->clientId);
 
    return RETURN_OK;
 }
@@ -1069,7 +1229,7 @@ static void disconnectEnet(ClientData *data)
             break;
 
          case ENET_EVENT_TYPE_DISCONNECT:
-            puts("Disconnection succeeded.");
+            LOG_I("Disconnection succeeded.");
             return;
       }
    }
@@ -1087,72 +1247,361 @@ static int deinitEnet(ClientData *data)
    return RETURN_OK;
 }
 
-static void handleJoin(ClientData *data, ENetEvent *event)
+static void gameClientEnter(ClientData *data, unsigned int clientId)
 {
    Client client;
-   PacketServerClientInformation *packet = (PacketServerClientInformation*)event->packet->data;
+
+   if (clientForId(data, clientId))
+      return;
 
    memset(&client, 0, sizeof(Client));
    client.actor.object = glhckCubeNew(1.0f);
    glhckObjectScalef(client.actor.object, 1.0f, 3.0f, 1.0f);
    client.actor.speed = data->me->actor.speed;
-   strncpy(client.host, packet->host, sizeof(client.host));
-   client.clientId = packet->clientId;
+   client.clientId = clientId;
 
    glhckObjectMaterial(client.actor.object, data->materials.player);
-   gameNewClient(data, &client);
-   printf("Client [%u] (%s) joined!\n", client.clientId, client.host);
+   if (!gameNewClient(data, &client)) {
+      LOG_W("Too many clients, ignoring [%u]", client.clientId);
+      glhckObjectFree(client.actor.object);
+      return;
+   }
+   LOG_I("Client [%u] joined!", client.clientId);
 }
 
-static void handlePart(ClientData *data, ENetEvent *event)
+static void gameClientLeave(ClientData *data, unsigned int clientId)
 {
    Client *client;
-   PacketServerClientPart *packet = (PacketServerClientPart*)event->packet->data;
 
-   if (!(client = clientForId(data, packet->clientId)))
+   if (!(client = clientForId(data, clientId)) || client == data->me)
       return;
 
-   printf("Client [%u] (%s) parted!\n", client->clientId, client->host);
+   LOG_I("Client [%u] parted!", client->clientId);
    glhckObjectFree(client->actor.object);
    gameFreeClient(data, client);
-   event->peer->data = NULL;
 }
 
-static void gameActorApplyPacket(ClientData *data, GameActor *actor, PacketServerActorState *packet)
+static void handleRoster(ClientData *data, ENetEvent *event)
+{
+   unsigned int i, enter, leave, id;
+   const unsigned char *ids = event->packet->data + sizeof(PacketServerRoster);
+   PacketServerRoster *packet = (PacketServerRoster*)event->packet->data;
+
+   if (event->packet->dataLength < sizeof(PacketServerRoster))
+      return;
+
+   enter = ntohs(packet->enter);
+   leave = ntohs(packet->leave);
+   if (event->packet->dataLength < sizeof(PacketServerRoster) + (enter + leave) * sizeof(unsigned int))
+      return;
+
+   /* an actor never enters and leaves in the same roster,
+    * leaving first frees room for the new ones */
+   for (i = 0; i != leave; ++i) {
+      memcpy(&id, ids + (enter + i) * sizeof(unsigned int), sizeof(unsigned int));
+      gameClientLeave(data, ntohl(id));
+   }
+   for (i = 0; i != enter; ++i) {
+      memcpy(&id, ids + i * sizeof(unsigned int), sizeof(unsigned int));
+      gameClientEnter(data, ntohl(id));
+   }
+}
+
+static void gameActorApplyInput(ClientData *data, GameActor *actor, unsigned char flags, unsigned char rotation)
 {
-   actor->flags = packet->flags;
-   actor->toRotation = TODEGS(packet->rotation);
+   actor->flags = flags;
+   actor->toBams = rotation;
+   actor->toRotation = simRotation(rotation);
 }
 
-static void handleState(ClientData *data, ENetEvent *event)
+static void gameActorApplyPosition(ClientData *data, GameActor *actor, const Vector3f *position)
+{
+   actor->toPosition.x = position->x;
+   actor->toPosition.y = position->y;
+   actor->toPosition.z = position->z;
+   if (!actor->shouldInterpolate) {
+      actor->rotation.y = actor->toRotation;
+      memcpy(&actor->position, &actor->toPosition, sizeof(kmVec3));
+      actor->shouldInterpolate = 1;
+   }
+}
+
+static void handleFullState(ClientData *data, ENetEvent *event)
 {
    Client *client;
-   PacketServerActorState *packet = (PacketServerActorState*)event->packet->data;
+   BitStream stream;
+   PacketActorFullState state;
+   PacketServerGeneric *packet = (PacketServerGeneric*)event->packet->data;
 
    if (!(client = clientForId(data, packet->clientId)))
       return;
 
-   gameActorApplyPacket(data, &client->actor, packet);
+   bitStreamInit(&stream, event->packet->data + sizeof(PacketServerGeneric), event->packet->dataLength - sizeof(PacketServerGeneric));
+   if (packetReadActorFullState(&stream, &state) != RETURN_OK)
+      return;
+
+   /* handle the delta part */
+   gameActorApplyInput(data, &client->actor, state.flags, state.rotation);
+   gameActorApplyPosition(data, &client->actor, &state.position);
+   LOG_D("GOT FULL STATE");
 }
 
-static void handleFullState(ClientData *data, ENetEvent *event)
+/* Server's state of our actor at an older step.
+ * Rewind there and replay our inputs since, if we went off. */
+static void handleCorrection(ClientData *data, ENetEvent *event)
 {
-   Client *client;
-   PacketServerActorFullState *packet = (PacketServerActorFullState*)event->packet->data;
+   unsigned short sequence;
+   BitStream stream;
+   SimState state;
+   PredictedStep *step;
+   PacketServerActorCorrection correction;
+   GameActor *actor = &data->me->actor;
+
+   bitStreamInit(&stream, event->packet->data + sizeof(PacketServerGeneric), event->packet->dataLength - sizeof(PacketServerGeneric));
+   if (packetReadActorCorrection(&stream, &correction) != RETURN_OK)
+      return;
 
-   if (!(client = clientForId(data, packet->clientId)))
+   /* sequenced on the state channel, enet already drops late ones.
+    * still skip anything not newer, a guard against wraparound */
+   if (data->hasCorrection && (short)(correction.sequence - data->corrected) <= 0)
+      return;
+
+   /* ahead of us, or too old to replay from */
+   if ((short)(data->sequence - correction.sequence) < 0 ||
+       (unsigned short)(data->sequence - correction.sequence) >= CLIENT_PREDICTION_SIZE)
+      return;
+
+   step = &data->predictions[correction.sequence % CLIENT_PREDICTION_SIZE];
+   if (step->sequence != correction.sequence)
+      return;
+
+   data->corrected = correction.sequence;
+   data->hasCorrection = 1;
+
+   /* server stepped past our newest input with something else,
+    * it never got it, send it again */
+   if (data->numInputs && (short)(correction.sequence - data->inputSequence) >= 0 &&
+       (correction.flags != data->inputs[0].flags || correction.rotation != data->inputs[0].rotation))
+      data->inputRepeats = 0;
+
+   if (fabsf(step->state.position.x - correction.position.x) < CLIENT_CORRECTION_TOLERANCE &&
+       fabsf(step->state.position.y - correction.position.y) < CLIENT_CORRECTION_TOLERANCE &&
+       fabsf(step->state.position.z - correction.position.z) < CLIENT_CORRECTION_TOLERANCE)
+      return;
+
+   LOG_D("Correcting step %u, off by %.2f %.2f %.2f", correction.sequence,
+         correction.position.x - step->state.position.x,
+         correction.position.y - step->state.position.y,
+         correction.position.z - step->state.position.z);
+
+   memcpy(&state.position, &correction.position, sizeof(Vector3f));
+   state.fallingSpeed = correction.fallingSpeed;
+   memcpy(&step->state, &state, sizeof(SimState));
+
+   for (sequence = correction.sequence + 1; sequence != (unsigned short)(data->sequence + 1); ++sequence) {
+      step = &data->predictions[sequence % CLIENT_PREDICTION_SIZE];
+      simStep(&state, step->flags, simRotation(step->rotation));
+      memcpy(&step->state, &state, sizeof(SimState));
+   }
+
+   /* rendering interpolates towards it */
+   actor->toPosition.x = state.position.x;
+   actor->toPosition.y = state.position.y;
+   actor->toPosition.z = state.position.z;
+   actor->fallingSpeed = state.fallingSpeed;
+}
+
+static void gameSendSnapshotAck(ClientData *data, unsigned int tick)
+{
+   PacketSnapshotAck ack;
+   memset(&ack, 0, sizeof(PacketSnapshotAck));
+   ack.id = PACKET_ID_SNAPSHOT_ACK;
+   ack.tick = htonl(tick);
+   gameSend(data, (unsigned char*)&ack, sizeof(PacketSnapshotAck), ENET_PACKET_FLAG_UNSEQUENCED);
+}
+
+int gameActorFlagsIsMoving(unsigned char flags)
+{
+   return (flags & ACTOR_FORWARD || flags & ACTOR_BACKWARD);
+}
+
+/* keep snapshot for playback, in server time order */
+static void gameActorBufferSnapshot(Client *client, const ActorSnapshot *snapshot, int full)
+{
+   unsigned int i;
+   ActorSnapshot *buffer = client->buffer;
+
+   /* actor (re)entered, older states are of no use */
+   if (full) client->buffered = 0;
+
+   for (i = client->buffered; i > 0 && buffer[i - 1].tick >= snapshot->tick; --i);
+   if (i < client->buffered && buffer[i].tick == snapshot->tick)
       return;
 
-   gameActorApplyPacket(data, &client->actor, (PacketServerActorState*)packet); /* handle the delta part */
-   client->actor.toPosition.x = packet->position.x;
-   client->actor.toPosition.y = packet->position.y;
-   client->actor.toPosition.z = packet->position.z;
-   if (!client->actor.shouldInterpolate) {
-      client->actor.rotation.y = client->actor.toRotation;
-      memcpy(&client->actor.position, &client->actor.toPosition, sizeof(kmVec3));
-      client->actor.shouldInterpolate = 1;
+   /* drop oldest when full, unless this is older still */
+   if (client->buffered == CLIENT_JITTER_SIZE) {
+      if (!i) return;
+      memmove(buffer, buffer + 1, --client->buffered * sizeof(ActorSnapshot));
+      i--;
    }
-   printf("GOT FULL STATE\n");
+
+   memmove(buffer + i + 1, buffer + i, (client->buffered - i) * sizeof(ActorSnapshot));
+   memcpy(&buffer[i], snapshot, sizeof(ActorSnapshot));
+   client->buffered++;
+}
+
+/* track how server time maps to ours and how much it wobbles */
+static void gamePlayoutUpdate(ClientData *data, unsigned int time)
+{
+   PlayoutClock *clock = &data->playout;
+   const double sample = time - glfwGetTime() * 1000.0;
+
+   if (!clock->valid) {
+      clock->offset = sample;
+      clock->jitter = 0.0;
+      clock->interval = 1000.0 / SIM_TICKRATE;
+      clock->lastTime = time;
+      clock->valid = 1;
+   } else {
+      if ((int)(time - clock->lastTime) > 0) {
+         clock->interval += ((time - clock->lastTime) - clock->interval) * 0.1;
+         clock->lastTime = time;
+      }
+      clock->jitter += (fabs(sample - clock->offset) - clock->jitter) * 0.1;
+      clock->offset += (sample - clock->offset) * 0.05;
+   }
+
+   /* one interval to have a pair to interpolate, jitter on top */
+   clock->delay = clock->interval + 2.0 * clock->jitter;
+   if (clock->delay > CLIENT_DELAY_MAX) clock->delay = CLIENT_DELAY_MAX;
+}
+
+/* place remote actor where it was at renderTime */
+static void gameActorPlayback(ClientData *data, Client *client)
+{
+   unsigned int i, back;
+   double t, dt;
+   signed char turn;
+   const ActorSnapshot *a, *b;
+   ActorSnapshot *buffer = client->buffer;
+   GameActor *actor = &client->actor;
+   const double now = data->renderTime;
+
+   if (!client->buffered)
+      return;
+
+   /* keep one state at or before now */
+   for (i = 0; i + 1 < client->buffered && buffer[i + 1].time <= now; ++i);
+   if (i) {
+      memmove(buffer, buffer + i, (client->buffered - i) * sizeof(ActorSnapshot));
+      client->buffered -= i;
+   }
+
+   a = &buffer[0];
+   actor->flags = a->flags;
+   actor->toRotation = TODEGS(a->rotation);
+   actor->toPosition.x = a->position.x;
+   actor->toPosition.y = a->position.y;
+   actor->toPosition.z = a->position.z;
+
+   if (client->buffered > 1 && now > a->time) {
+      /* between two states */
+      b = &buffer[1];
+      t = (now - a->time) / (double)(b->time - a->time);
+      turn = b->rotation - a->rotation;
+      actor->toRotation = TODEGS(a->rotation + turn * t);
+      actor->toPosition.x += (b->position.x - a->position.x) * t;
+      actor->toPosition.y += (b->position.y - a->position.y) * t;
+      actor->toPosition.z += (b->position.z - a->position.z) * t;
+   } else if (client->buffered == 1 && now > a->time && gameActorFlagsIsMoving(a->flags)) {
+      /* ran out of states, keep going for a while the way it was moving */
+      dt = (now - a->time < CLIENT_EXTRAPOLATE_MAX ? now - a->time : CLIENT_EXTRAPOLATE_MAX);
+
+      /* newest earlier state, entries the server deferred leave gaps */
+      for (back = 1; back < SNAPSHOT_HISTORY && back < a->tick; ++back) {
+         b = &client->snapshots[(a->tick - back) % SNAPSHOT_HISTORY];
+         if (b->tick != a->tick - back) continue;
+         if (a->time > b->time && a->time - b->time <= CLIENT_EXTRAPOLATE_MAX) {
+            t = dt / (double)(a->time - b->time);
+            actor->toPosition.x += (a->position.x - b->position.x) * t;
+            actor->toPosition.y += (a->position.y - b->position.y) * t;
+            actor->toPosition.z += (a->position.z - b->position.z) * t;
+         }
+         break;
+      }
+   }
+
+   /* time based, no per frame smoothing needed */
+   if (!actor->shouldInterpolate) {
+      actor->rotation.y = actor->toRotation;
+      actor->shouldInterpolate = 1;
+   }
+   memcpy(&actor->position, &actor->toPosition, sizeof(kmVec3));
+}
+
+static void handleSnapshot(ClientData *data, ENetEvent *event)
+{
+   unsigned int i, n, tick, time, skipped = 0;
+   BitStream stream;
+   Client *client, *clients[255];
+   ActorSnapshot *base, decoded[255];
+   PacketSnapshotActor actor;
+   char full[255];
+   PacketServerSnapshot *packet = (PacketServerSnapshot*)event->packet->data;
+
+   if (event->packet->dataLength < sizeof(PacketServerSnapshot))
+      return;
+
+   /* decode everything first, a malformed snapshot is dropped whole */
+   tick = ntohl(packet->tick);
+   time = ntohl(packet->time);
+   bitStreamInit(&stream, event->packet->data + sizeof(PacketServerSnapshot), event->packet->dataLength - sizeof(PacketServerSnapshot));
+   for (i = 0, n = 0; i < packet->count; ++i) {
+      if (packetReadSnapshotActor(&stream, &actor) != RETURN_OK)
+         return;
+
+      /* roster comes on the other channel and may still be on its way,
+       * or we lost the baseline. skip the actor, the rest still apply */
+      if (!(client = clientForId(data, actor.clientId))) {
+         skipped++;
+         continue;
+      }
+
+      if (actor.base) {
+         base = &client->snapshots[(tick - actor.base) % SNAPSHOT_HISTORY];
+         if (base->tick != tick - actor.base) {
+            skipped++;
+            continue;
+         }
+         memcpy(&decoded[n], base, sizeof(ActorSnapshot));
+      } else {
+         memset(&decoded[n], 0, sizeof(ActorSnapshot));
+      }
+
+      if (actor.mask & SNAPSHOT_FLAGS) decoded[n].flags = actor.flags;
+      if (actor.mask & SNAPSHOT_ROTATION) decoded[n].rotation = actor.rotation;
+      if (actor.mask & SNAPSHOT_POSITION_X) decoded[n].position.x = actor.position.x;
+      if (actor.mask & SNAPSHOT_POSITION_Y) decoded[n].position.y = actor.position.y;
+      if (actor.mask & SNAPSHOT_POSITION_Z) decoded[n].position.z = actor.position.z;
+
+      decoded[n].tick = tick;
+      clients[n] = client;
+      full[n++] = !actor.base;
+   }
+
+   gamePlayoutUpdate(data, time);
+   for (i = 0; i < n; ++i) {
+      decoded[i].time = time;
+      memcpy(&clients[i]->snapshots[tick % SNAPSHOT_HISTORY], &decoded[i], sizeof(ActorSnapshot));
+      if (clients[i] != data->me) gameActorBufferSnapshot(clients[i], &decoded[i], full[i]);
+   }
+
+   /* actors left out are either up to date or deferred by the server's
+    * budget, playback interpolates over the gap or extrapolates into it.
+    * an ack would make this the baseline of skipped actors too, so the
+    * server keeps diffing against older ones until we have them all */
+   if (!skipped)
+      gameSendSnapshotAck(data, tick);
 }
 
 static int manageEnet(ClientData *data)
@@ -1166,10 +1615,12 @@ static int manageEnet(ClientData *data)
       switch (event.type) {
          case ENET_EVENT_TYPE_RECEIVE:
             /* discard bad packets */
-            if (event.packet->dataLength < sizeof(PacketServerGeneric))
+            if (event.packet->dataLength < sizeof(PacketServerGeneric)) {
+               enet_packet_destroy(event.packet);
                break;
+            }
 
-            printf("A packet of length %u was received on channel %u.\n",
+            LOG_D("A packet of length %zu was received on channel %u.",
                   event.packet->dataLength,
                   event.channelID);
 
@@ -1177,18 +1628,18 @@ static int manageEnet(ClientData *data)
             packet = (PacketServerGeneric*)event.packet->data;
             packet->clientId = ntohl(packet->clientId);
             switch (packet->id) {
-               case PACKET_ID_CLIENT_INFORMATION:
-                  handleJoin(data, &event);
-                  break;
-               case PACKET_ID_CLIENT_PART:
-                  handlePart(data, &event);
-                  break;
-               case PACKET_ID_ACTOR_STATE:
-                  handleState(data, &event);
+               case PACKET_ID_ROSTER:
+                  handleRoster(data, &event);
                   break;
                case PACKET_ID_ACTOR_FULL_STATE:
                   handleFullState(data, &event);
                   break;
+               case PACKET_ID_SNAPSHOT:
+                  handleSnapshot(data, &event);
+                  break;
+               case PACKET_ID_ACTOR_CORRECTION:
+                  handleCorrection(data, &event);
+                  break;
             }
 
             /* Clean up the packet now that we're done using it. */
@@ -1200,11 +1651,6 @@ static int manageEnet(ClientData *data)
    return RETURN_OK;
 }
 
-int gameActorFlagsIsMoving(unsigned char flags)
-{
-   return (flags & ACTOR_FORWARD || flags & ACTOR_BACKWARD);
-}
-
 void gameCameraUpdate(ClientData *data, GameCamera *camera, GameActor *target)
 {
    float speed = camera->speed * data->delta;
@@ -1281,33 +1727,56 @@ void gameActorCollisionResponse(const CollisionOutData *data)
 }
 #endif
 
-void gameActorUpdate(ClientData *data, GameActor *actor)
+/* number the step and remember it for replay */
+static void gameRecordPrediction(ClientData *data, GameActor *actor, const SimState *state)
 {
-   float speed = actor->speed * data->delta * ((actor->flags & ACTOR_SPRINT)?2.0f:1.0f);
-
-   if (actor != &data->me->actor) {
-      float cspeed = data->camera.rotationSpeed * data->delta; /* camera speed for other players */
-      if (actor->flags & ACTOR_LEFT) {
-         actor->toRotation += cspeed;
-      }
-      if (actor->flags & ACTOR_RIGHT) {
-         actor->toRotation -= cspeed;
-      }
+   PredictedStep *last = &data->predictions[data->sequence % CLIENT_PREDICTION_SIZE];
+   PredictedStep *step = &data->predictions[++data->sequence % CLIENT_PREDICTION_SIZE];
+   const unsigned char rotation = actor->toBams;
+
+   if (last->sequence != (unsigned short)(data->sequence - 1) ||
+       last->flags != actor->flags || last->rotation != rotation) {
+      data->inputSequence = data->sequence;
+
+      /* new input, goes out with the next few packets */
+      memmove(data->inputs + 1, data->inputs, (ACTOR_INPUT_REDUNDANCY - 1) * sizeof(ActorInput));
+      data->inputs[0].flags = actor->flags;
+      data->inputs[0].rotation = rotation;
+      data->inputs[0].sequence = data->sequence;
+      if (data->numInputs < ACTOR_INPUT_REDUNDANCY) data->numInputs++;
+      data->inputRepeats = 0;
    }
 
-   if (actor->flags & ACTOR_JUMP) {
-      actor->toPosition.y += speed*8;
-      actor->fallingSpeed = 0.0f;
-      actor->flags &= ~ACTOR_JUMP;
-   } else {
-      actor->toPosition.y -= actor->fallingSpeed;
-      actor->fallingSpeed += speed * 0.01f;
+   step->sequence = data->sequence;
+   step->flags = actor->flags;
+   step->rotation = rotation;
+   memcpy(&step->state, state, sizeof(SimState));
+}
+
+void gameActorUpdate(ClientData *data, GameActor *actor)
+{
+   unsigned int i;
+   SimState state;
+   const int local = (actor == &data->me->actor);
+
+   /* predict with the same steps the server takes,
+    * others are placed by gameActorPlayback */
+   if (local) {
+      state.position.x = actor->toPosition.x;
+      state.position.y = actor->toPosition.y;
+      state.position.z = actor->toPosition.z;
+      state.fallingSpeed = actor->fallingSpeed;
+      for (i = 0; i < data->simSteps; ++i) {
+         simStep(&state, actor->flags, simRotation(actor->toBams));
+         gameRecordPrediction(data, actor, &state);
+      }
+      actor->toPosition.x = state.position.x;
+      actor->toPosition.y = state.position.y;
+      actor->toPosition.z = state.position.z;
+      actor->fallingSpeed = state.fallingSpeed;
    }
 
    if (actor->flags & ACTOR_FORWARD) {
-      actor->toPosition.x -= speed * cosf(kmDegreesToRadians(actor->toRotation + 90));
-      actor->toPosition.z += speed * sinf(kmDegreesToRadians(actor->toRotation + 90));
-
       kmVec3 targetRotation = {0.0f,actor->toRotation,0.0f};
 #if 0 /* the interpolation needs to wrap around 360 */
       kmVec3Interpolate(&actor->rotation, &actor->rotation, &targetRotation, 0.18f);
@@ -1317,9 +1786,6 @@ void gameActorUpdate(ClientData *data, GameActor *actor)
    }
 
    if (actor->flags & ACTOR_BACKWARD) {
-      actor->toPosition.x += speed * cosf(kmDegreesToRadians(actor->toRotation + 90));
-      actor->toPosition.z -= speed * sinf(kmDegreesToRadians(actor->toRotation + 90));
-
       kmVec3 targetRotation = {0.0f,actor->toRotation + 180.0f,0.0f};
 #if 0 /* the interpolation needs to wrap around 360 */
       kmVec3Interpolate(&actor->rotation, &actor->rotation, &targetRotation, 0.18f);
@@ -1367,17 +1833,13 @@ void gameActorUpdate(ClientData *data, GameActor *actor)
    /* assign last position */
    kmVec3Assign(&actor->lastPosition, &actor->position);
 
-   /* limit */
-   if (actor->toPosition.y < 0.0f) {
-      actor->toPosition.y = 0.0f;
-      actor->fallingSpeed = 0.0f;
-   }
-
-   /* movement interpolation */
-   if (gameActorFlagsIsMoving(actor->flags)) {
-      kmVec3Interpolate(&actor->position, &actor->position, &actor->toPosition, 0.25f);
-   } else {
-      kmVec3Interpolate(&actor->position, &actor->position, &actor->toPosition, 0.1f);
+   /* smooth out corrections of our own actor */
+   if (local) {
+      if (gameActorFlagsIsMoving(actor->flags)) {
+         kmVec3Interpolate(&actor->position, &actor->position, &actor->toPosition, 0.25f);
+      } else {
+         kmVec3Interpolate(&actor->position, &actor->position, &actor->toPosition, 0.1f);
+      }
    }
 
    glhckObjectRotation(actor->object, &actor->rotation);
@@ -1413,35 +1875,39 @@ void gameActorUpdateFrom3rdPersonCamera(ClientData *data, GameActor *actor, Game
       }
    }
 
-   /* convert bams and back to resemble the rotation sent to server */
+   /* quantize once, prediction steps with exactly what the server gets */
    unsigned char bams = TOBAMS(camera->rotation.y); bams &= 0xff;
-   actor->toRotation  = TODEGS(bams);
+   actor->toBams      = bams;
+   actor->toRotation  = simRotation(bams);
    gameActorUpdate(data, actor);
 }
 
 void gameSendPlayerState(ClientData *data)
 {
-   PacketActorState state;
-   memset(&state, 0, sizeof(PacketActorState));
-   state.id = PACKET_ID_ACTOR_STATE;
-   state.flags = data->me->actor.flags;
-   state.rotation = TOBAMS(data->me->actor.toRotation);
-   state.rotation &= 0xff;
-   gameSend(data, (unsigned char*)&state, sizeof(PacketActorState), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
-}
+   unsigned int i, count;
+   unsigned char pdata[sizeof(PacketActorState) + ACTOR_INPUT_REDUNDANCY * sizeof(ActorInput)];
+   PacketActorState *state = (PacketActorState*)pdata;
+   ActorInput *inputs = (ActorInput*)(pdata + sizeof(PacketActorState));
 
-void gameSendFullPlayerState(ClientData *data)
-{
-   PacketActorFullState state;
-   memset(&state, 0, sizeof(PacketActorFullState));
-   state.id = PACKET_ID_ACTOR_FULL_STATE;
-   state.flags = data->me->actor.flags;
-   state.rotation = TOBAMS(data->me->actor.toRotation);
-   state.rotation &= 0xff;
-   state.position.x = data->me->actor.toPosition.x;
-   state.position.y = data->me->actor.toPosition.y;
-   state.position.z = data->me->actor.toPosition.z;
-   gameSend(data, (unsigned char*)&state, sizeof(PacketActorFullState), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+   if (!data->numInputs)
+      return;
+
+   /* redundant copies went out already, only keep the newest alive */
+   count = data->numInputs;
+   if (data->inputRepeats++ >= ACTOR_INPUT_REDUNDANCY) {
+      if ((data->inputRepeats - ACTOR_INPUT_REDUNDANCY) % CLIENT_INPUT_KEEPALIVE)
+         return;
+      count = 1;
+   }
+
+   /* server numbers its steps from ours */
+   state->id = PACKET_ID_ACTOR_STATE;
+   state->count = count;
+   for (i = 0; i != count; ++i) {
+      memcpy(&inputs[i], &data->inputs[i], sizeof(ActorInput));
+      inputs[i].sequence = htons(data->inputs[i].sequence);
+   }
+   gameSend(data, pdata, sizeof(PacketActorState) + count * sizeof(ActorInput), 0);
 }
 
 int main(int argc, char **argv)
@@ -1599,8 +2065,11 @@ int main(int argc, char **argv)
 
    const char *host = getenv("SRVBIRTH_SERVER");
    if (!host) host = "localhost";
-   if (initEnet(host, 1234, &data) != RETURN_OK)
+   logInit();
+   if (initEnet(host, 1234, &data) != RETURN_OK) {
+      logDeinit();
       return EXIT_FAILURE;
+   }
 
    data.materials.me = glhckMaterialNew(NULL);
    data.materials.player = glhckMaterialNew(NULL);
@@ -1782,7 +2251,6 @@ int main(int argc, char **argv)
    RUNNING = 1;
    int col = 0;
    float anim = 0.0f;
-   float fullStateTime = glfwGetTime() + 5.0f;
    float botTime = glfwGetTime();
    unsigned char botFlags = 0;
    srand(time(NULL));
@@ -1792,6 +2260,13 @@ int main(int argc, char **argv)
       data.delta = now - last;
       glfwPollEvents();
 
+      /* fixed simulation steps, don't spiral if a frame took long */
+      data.simTime += data.delta;
+      for (data.simSteps = 0; data.simTime >= SIM_STEP; data.simTime -= SIM_STEP)
+         data.simSteps++;
+      if (data.simSteps > SIM_TICKRATE) data.simSteps = SIM_TICKRATE;
+      data.renderTime = glfwGetTime() * 1000.0 + data.playout.offset - data.playout.delay;
+
       camera->lastFlags = camera->flags;
       camera->flags = CAMERA_NONE;
       if (camera->lastFlags & CAMERA_SLIDE) camera->flags |= CAMERA_SLIDE;
@@ -1874,7 +2349,9 @@ int main(int argc, char **argv)
       gameActorUpdateFrom3rdPersonCamera(&data, player, camera);
 
       for (c2 = data.clients; c2; c2 = c2->next) {
-         if (&c2->actor != player) gameActorUpdate(&data, &c2->actor);
+         if (&c2->actor == player) continue;
+         gameActorPlayback(&data, c2);
+         gameActorUpdate(&data, &c2->actor);
       }
 
       glhckCameraUpdate(camera->object);
@@ -1931,24 +2408,14 @@ int main(int argc, char **argv)
 
       /* manage packets */
       manageEnet(&data);
-      if (gameActorFlagsIsMoving(player->flags) && fullStateTime < now) {
-         gameSendFullPlayerState(&data);
-         fullStateTime = now + 5.0f;
-         puts("SEND FULL");
-      } else if (player->flags != player->lastFlags) {
-         if (!gameActorFlagsIsMoving(player->flags) &&
-              gameActorFlagsIsMoving(player->lastFlags) &&
-              now-player->lastActTime > 2.0f) {
-            gameSendFullPlayerState(&data);
-            fullStateTime = now + 5.0f;
-            printf("SEND FULL: %.0f\n", now-player->lastActTime);
-         } else if (gameActorFlagsIsMoving(player->flags) !=
-               gameActorFlagsIsMoving(player->lastFlags)) {
-            player->lastActTime = now;
-            gameSendPlayerState(&data);
-         } else {
-            gameSendPlayerState(&data);
-         }
+
+      /* server simulates us from inputs, sent at a fixed rate
+       * no matter how fast we draw, don't burst after a stall */
+      data.inputTime += data.delta;
+      if (data.inputTime >= data.inputInterval) {
+         data.inputTime -= data.inputInterval;
+         if (data.inputTime >= data.inputInterval) data.inputTime = 0.0f;
+         gameSendPlayerState(&data);
       }
       enet_host_flush(data.client);
 
@@ -1968,5 +2435,6 @@ int main(int argc, char **argv)
    deinitEnet(&data);
    glhckContextTerminate();
    glfwTerminate();
+   logDeinit();
    return EXIT_SUCCESS;
 }
@@ -1,6 +1,23 @@
 #include <arpa/inet.h>
 #include "bams.h"
 
-/* FIXME: Floating point packing code here.
- * Should pack to IEEE-754 when sending, and unpack when recieving.
- * If host system isn't using the representation. */
+/* Floats never go to the wire as is,
+ * they are quantized to fixed point and bit packed instead. */
+
+unsigned int quantize(float value, const Quantization *q)
+{
+   const unsigned int max = (1u << q->bits) - 1;
+   const float step = (q->max - q->min) / (1u << q->bits);
+   float v = (value - q->min) / step + 0.5f;
+
+   /* clamp to range */
+   if (v < 0.0f) return 0;
+   if (v >= max) return max;
+   return (unsigned int)v;
+}
+
+float dequantize(unsigned int value, const Quantization *q)
+{
+   const float step = (q->max - q->min) / (1u << q->bits);
+   return q->min + value * step;
+}
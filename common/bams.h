@@ -13,6 +13,20 @@ typedef struct Vector2f {
 #define TOBAMS(x) (((x)/360.0) * 256)
 #define TODEGS(b) (((b)/256.0) * 360)
 
+/* Fixed point quantization, same idea as bams but for
+ * arbitrary ranges. Values in [min, max) map to bits wide integers. */
+typedef struct Quantization {
+   float min, max;
+   unsigned int bits;
+} Quantization;
+
+typedef struct Vector3fQuantization {
+   Quantization x, y, z;
+} Vector3fQuantization;
+
+unsigned int quantize(float value, const Quantization *q);
+float dequantize(unsigned int value, const Quantization *q);
+
 #endif /* SRVBIRTH_BAMS_H */
 
 /* vim: set ts=8 sw=3 tw=0 :*/
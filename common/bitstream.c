@@ -0,0 +1,102 @@
+#include <string.h>
+#include <assert.h>
+#include "bitstream.h"
+
+void bitStreamInit(BitStream *stream, unsigned char *data, size_t size)
+{
+   assert(stream && (data || !size));
+   memset(stream, 0, sizeof(BitStream));
+   stream->data = data;
+   stream->size = size;
+}
+
+void bitStreamWrite(BitStream *stream, unsigned int value, unsigned int bits)
+{
+   unsigned int used, n;
+   unsigned char *byte;
+   assert(stream && bits <= 32);
+
+   if (stream->bit + bits > stream->size * 8) {
+      stream->overflow = 1;
+      return;
+   }
+
+   while (bits) {
+      byte = &stream->data[stream->bit / 8];
+      used = stream->bit % 8;
+      n = 8 - used;
+      if (n > bits) n = bits;
+
+      /* start of fresh byte */
+      if (!used) *byte = 0;
+
+      *byte |= ((value >> (bits - n)) & ((1u << n) - 1)) << (8 - used - n);
+      stream->bit += n;
+      bits -= n;
+   }
+}
+
+unsigned int bitStreamRead(BitStream *stream, unsigned int bits)
+{
+   unsigned int used, n, value = 0;
+   assert(stream && bits <= 32);
+
+   if (stream->bit + bits > stream->size * 8) {
+      stream->overflow = 1;
+      return 0;
+   }
+
+   while (bits) {
+      used = stream->bit % 8;
+      n = 8 - used;
+      if (n > bits) n = bits;
+
+      value = (value << n) | ((stream->data[stream->bit / 8] >> (8 - used - n)) & ((1u << n) - 1));
+      stream->bit += n;
+      bits -= n;
+   }
+
+   return value;
+}
+
+void bitStreamAlign(BitStream *stream)
+{
+   assert(stream);
+   stream->bit = (stream->bit + 7) & ~(size_t)7;
+   if (stream->bit > stream->size * 8) {
+      stream->bit = stream->size * 8;
+      stream->overflow = 1;
+   }
+}
+
+size_t bitStreamBytes(const BitStream *stream)
+{
+   assert(stream);
+   return (stream->bit + 7) / 8;
+}
+
+void bitStreamWriteFloat(BitStream *stream, float value, const Quantization *q)
+{
+   bitStreamWrite(stream, quantize(value, q), q->bits);
+}
+
+float bitStreamReadFloat(BitStream *stream, const Quantization *q)
+{
+   return dequantize(bitStreamRead(stream, q->bits), q);
+}
+
+void bitStreamWriteVector3f(BitStream *stream, const Vector3f *value, const Vector3fQuantization *q)
+{
+   bitStreamWriteFloat(stream, value->x, &q->x);
+   bitStreamWriteFloat(stream, value->y, &q->y);
+   bitStreamWriteFloat(stream, value->z, &q->z);
+}
+
+void bitStreamReadVector3f(BitStream *stream, Vector3f *value, const Vector3fQuantization *q)
+{
+   value->x = bitStreamReadFloat(stream, &q->x);
+   value->y = bitStreamReadFloat(stream, &q->y);
+   value->z = bitStreamReadFloat(stream, &q->z);
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,31 @@
+#ifndef SRVBIRTH_BITSTREAM_H
+#define SRVBIRTH_BITSTREAM_H
+
+#include <stddef.h>
+#include "bams.h"
+
+/* Bit packing reader/writer.
+ * Bits are stored most significant first,
+ * so the stream doesn't depend on host byte order. */
+typedef struct BitStream {
+   unsigned char *data;
+   size_t size; /* in bytes */
+   size_t bit;  /* cursor */
+   int overflow; /* set when reading or writing past the end */
+} BitStream;
+
+void bitStreamInit(BitStream *stream, unsigned char *data, size_t size);
+void bitStreamWrite(BitStream *stream, unsigned int value, unsigned int bits);
+unsigned int bitStreamRead(BitStream *stream, unsigned int bits);
+void bitStreamAlign(BitStream *stream);
+size_t bitStreamBytes(const BitStream *stream);
+
+/* quantized floats */
+void bitStreamWriteFloat(BitStream *stream, float value, const Quantization *q);
+float bitStreamReadFloat(BitStream *stream, const Quantization *q);
+void bitStreamWriteVector3f(BitStream *stream, const Vector3f *value, const Vector3fQuantization *q);
+void bitStreamReadVector3f(BitStream *stream, Vector3f *value, const Vector3fQuantization *q);
+
+#endif /* SRVBIRTH_BITSTREAM_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+#include "queue.h"
+#include "types.h"
+
+/* idle time of the flush thread */
+#define LOG_FLUSH_INTERVAL_MS 10
+
+typedef struct LogEntry {
+   unsigned char level;
+   struct timespec time;
+   char text[LOG_LINE_SIZE];
+} LogEntry;
+
+typedef struct LogRing {
+   Queue *queue;
+   atomic_ulong dropped; /* written by owner, read by flusher */
+   unsigned long reported;
+   struct LogRing *next;
+} LogRing;
+
+volatile int logLevel = LOG_INFO;
+
+static struct {
+   pthread_mutex_t lock; /* guards rings list */
+   pthread_t thread;
+   LogRing *rings;
+   volatile int running;
+} logger = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0 };
+
+static __thread LogRing *threadRing = NULL;
+
+static const char *levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/* register ring for the calling thread on first use */
+static LogRing* logRing(void)
+{
+   LogRing *ring;
+   if (threadRing)
+      return threadRing;
+
+   if (!(ring = calloc(1, sizeof(LogRing))))
+      return NULL;
+
+   if (!(ring->queue = queueNew(LOG_RING_SIZE, sizeof(LogEntry)))) {
+      free(ring);
+      return NULL;
+   }
+
+   pthread_mutex_lock(&logger.lock);
+   ring->next = logger.rings;
+   logger.rings = ring;
+   pthread_mutex_unlock(&logger.lock);
+   return (threadRing = ring);
+}
+
+static void logPrint(const LogEntry *entry)
+{
+   FILE *out = (entry->level >= LOG_WARN ? stderr : stdout);
+   fprintf(out, "%ld.%03ld [%s] %s\n", (long)entry->time.tv_sec, entry->time.tv_nsec / 1000000,
+         levelNames[entry->level], entry->text);
+}
+
+/* write out everything queued, returns number of lines */
+static unsigned int logFlush(void)
+{
+   LogRing *ring;
+   LogEntry entry;
+   unsigned long dropped;
+   unsigned int count = 0;
+
+   pthread_mutex_lock(&logger.lock);
+   for (ring = logger.rings; ring; ring = ring->next) {
+      while (queuePop(ring->queue, &entry) == RETURN_OK) {
+         logPrint(&entry);
+         count++;
+      }
+
+      if ((dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed)) != ring->reported) {
+         fprintf(stderr, "log: %lu lines dropped\n", dropped - ring->reported);
+         ring->reported = dropped;
+      }
+   }
+   pthread_mutex_unlock(&logger.lock);
+
+   if (count) {
+      fflush(stdout);
+      fflush(stderr);
+   }
+   return count;
+}
+
+static void* logThread(void *arg)
+{
+   const struct timespec idle = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+   (void)arg;
+
+   while (logger.running) {
+      if (!logFlush())
+         nanosleep(&idle, NULL);
+   }
+
+   logFlush();
+   return NULL;
+}
+
+int logInit(void)
+{
+   const char *level;
+   unsigned int i;
+
+   if ((level = getenv("SRVBIRTH_LOGLEVEL"))) {
+      for (i = 0; i != sizeof(levelNames) / sizeof(levelNames[0]); ++i)
+         if (!strcasecmp(level, levelNames[i])) logLevel = i;
+      if (!strcasecmp(level, "none")) logLevel = LOG_NONE;
+   }
+
+   logger.running = 1;
+   if (pthread_create(&logger.thread, NULL, logThread, NULL) != 0) {
+      logger.running = 0;
+      return RETURN_FAIL;
+   }
+
+   return RETURN_OK;
+}
+
+void logDeinit(void)
+{
+   LogRing *ring, *next;
+
+   if (logger.running) {
+      logger.running = 0;
+      pthread_join(logger.thread, NULL);
+   }
+
+   /* only call after other threads stopped logging */
+   for (ring = logger.rings; ring; ring = next) {
+      next = ring->next;
+      queueFree(ring->queue);
+      free(ring);
+   }
+   logger.rings = NULL;
+   threadRing = NULL;
+}
+
+void logWrite(LogLevel level, const char *fmt, ...)
+{
+   va_list args;
+   LogEntry entry;
+   LogRing *ring;
+   assert(level < LOG_NONE && fmt);
+
+   entry.level = level;
+   clock_gettime(CLOCK_REALTIME, &entry.time);
+   va_start(args, fmt);
+   vsnprintf(entry.text, sizeof(entry.text), fmt, args);
+   va_end(args);
+
+   /* no flush thread, or no memory for a ring */
+   if (!logger.running || !(ring = logRing())) {
+      logPrint(&entry);
+      return;
+   }
+
+   if (queuePush(ring->queue, &entry) != RETURN_OK)
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,38 @@
+#ifndef SRVBIRTH_LOG_H
+#define SRVBIRTH_LOG_H
+
+/* Leveled asynchronous logger.
+ * Lines are formatted into a ring owned by the calling thread,
+ * and a background thread writes them out. */
+typedef enum LogLevel {
+   LOG_DEBUG,
+   LOG_INFO,
+   LOG_WARN,
+   LOG_ERROR,
+   LOG_NONE,
+} LogLevel;
+
+/* maximum length of one line, longer lines are truncated */
+#define LOG_LINE_SIZE 256
+
+/* lines each thread can have waiting for the flush thread */
+#define LOG_RING_SIZE 1024
+
+extern volatile int logLevel;
+
+/* disabled levels cost one compare, arguments are not evaluated */
+#define LOG(level, ...) do { if ((level) >= logLevel) logWrite((level), __VA_ARGS__); } while (0)
+#define LOG_D(...) LOG(LOG_DEBUG, __VA_ARGS__)
+#define LOG_I(...) LOG(LOG_INFO, __VA_ARGS__)
+#define LOG_W(...) LOG(LOG_WARN, __VA_ARGS__)
+#define LOG_E(...) LOG(LOG_ERROR, __VA_ARGS__)
+
+/* level is read from SRVBIRTH_LOGLEVEL environment variable
+ * (debug, info, warn, error, none), defaults to info */
+int logInit(void);
+void logDeinit(void);
+void logWrite(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* SRVBIRTH_LOG_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,90 @@
+#include <string.h>
+#include <assert.h>
+#include "packet.h"
+
+static const Vector3fQuantization worldQuantization = WORLD_QUANTIZATION;
+static const Quantization fallQuantization = FALL_QUANTIZATION;
+
+void packetWriteActorFullState(BitStream *stream, const PacketActorFullState *packet)
+{
+   assert(stream && packet);
+   bitStreamWrite(stream, packet->flags, ACTOR_FLAGS_BITS);
+   bitStreamWrite(stream, packet->rotation, 8);
+   bitStreamWriteVector3f(stream, &packet->position, &worldQuantization);
+}
+
+int packetReadActorFullState(BitStream *stream, PacketActorFullState *packet)
+{
+   assert(stream && packet);
+   packet->flags = bitStreamRead(stream, ACTOR_FLAGS_BITS);
+   packet->rotation = bitStreamRead(stream, 8);
+   bitStreamReadVector3f(stream, &packet->position, &worldQuantization);
+   return (stream->overflow ? RETURN_FAIL : RETURN_OK);
+}
+
+void packetWriteSnapshotActor(BitStream *stream, const PacketSnapshotActor *actor)
+{
+   assert(stream && actor);
+   bitStreamWrite(stream, actor->clientId, 32);
+   bitStreamWrite(stream, actor->base, SNAPSHOT_HISTORY_BITS);
+   bitStreamWrite(stream, actor->mask, SNAPSHOT_MASK_BITS);
+
+   if (actor->mask & SNAPSHOT_FLAGS)
+      bitStreamWrite(stream, actor->flags, ACTOR_FLAGS_BITS);
+   if (actor->mask & SNAPSHOT_ROTATION)
+      bitStreamWrite(stream, actor->rotation, 8);
+   if (actor->mask & SNAPSHOT_POSITION_X)
+      bitStreamWriteFloat(stream, actor->position.x, &worldQuantization.x);
+   if (actor->mask & SNAPSHOT_POSITION_Y)
+      bitStreamWriteFloat(stream, actor->position.y, &worldQuantization.y);
+   if (actor->mask & SNAPSHOT_POSITION_Z)
+      bitStreamWriteFloat(stream, actor->position.z, &worldQuantization.z);
+
+   bitStreamAlign(stream);
+}
+
+int packetReadSnapshotActor(BitStream *stream, PacketSnapshotActor *actor)
+{
+   assert(stream && actor);
+   memset(actor, 0, sizeof(PacketSnapshotActor));
+   actor->clientId = bitStreamRead(stream, 32);
+   actor->base = bitStreamRead(stream, SNAPSHOT_HISTORY_BITS);
+   actor->mask = bitStreamRead(stream, SNAPSHOT_MASK_BITS);
+
+   if (actor->mask & SNAPSHOT_FLAGS)
+      actor->flags = bitStreamRead(stream, ACTOR_FLAGS_BITS);
+   if (actor->mask & SNAPSHOT_ROTATION)
+      actor->rotation = bitStreamRead(stream, 8);
+   if (actor->mask & SNAPSHOT_POSITION_X)
+      actor->position.x = bitStreamReadFloat(stream, &worldQuantization.x);
+   if (actor->mask & SNAPSHOT_POSITION_Y)
+      actor->position.y = bitStreamReadFloat(stream, &worldQuantization.y);
+   if (actor->mask & SNAPSHOT_POSITION_Z)
+      actor->position.z = bitStreamReadFloat(stream, &worldQuantization.z);
+
+   bitStreamAlign(stream);
+   return (stream->overflow ? RETURN_FAIL : RETURN_OK);
+}
+
+void packetWriteActorCorrection(BitStream *stream, const PacketServerActorCorrection *packet)
+{
+   assert(stream && packet);
+   bitStreamWrite(stream, packet->sequence, 16);
+   bitStreamWrite(stream, packet->flags, ACTOR_FLAGS_BITS);
+   bitStreamWrite(stream, packet->rotation, 8);
+   bitStreamWriteVector3f(stream, &packet->position, &worldQuantization);
+   bitStreamWriteFloat(stream, packet->fallingSpeed, &fallQuantization);
+}
+
+int packetReadActorCorrection(BitStream *stream, PacketServerActorCorrection *packet)
+{
+   assert(stream && packet);
+   packet->sequence = bitStreamRead(stream, 16);
+   packet->flags = bitStreamRead(stream, ACTOR_FLAGS_BITS);
+   packet->rotation = bitStreamRead(stream, 8);
+   bitStreamReadVector3f(stream, &packet->position, &worldQuantization);
+   packet->fallingSpeed = bitStreamReadFloat(stream, &fallQuantization);
+   return (stream->overflow ? RETURN_FAIL : RETURN_OK);
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
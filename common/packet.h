@@ -0,0 +1,36 @@
+#ifndef SRVBIRTH_PACKET_H
+#define SRVBIRTH_PACKET_H
+
+#include "types.h"
+#include "bitstream.h"
+
+/* Bit packed wire format for packet bodies.
+ *
+ * Packet headers (PACKET_CLIENT_HEADER, PACKET_SERVER_HEADER)
+ * stay byte aligned in front, so the id can be peeked without
+ * decoding. Everything after the header is written with these.
+ *
+ * Read functions return RETURN_OK, or RETURN_FAIL if the
+ * stream ran out before the body was complete. */
+
+/* largest possible bodies in bytes */
+#define PACKET_ACTOR_FULL_STATE_SIZE   7
+#define PACKET_SNAPSHOT_ACTOR_SIZE     13
+#define PACKET_ACTOR_CORRECTION_SIZE   11
+
+/* flags, rotation and quantized position.
+ * Same body for PacketActorFullState and PacketServerActorFullState. */
+void packetWriteActorFullState(BitStream *stream, const PacketActorFullState *packet);
+int packetReadActorFullState(BitStream *stream, PacketActorFullState *packet);
+
+/* snapshot entries are byte aligned, so encoded entries can be copied around */
+void packetWriteSnapshotActor(BitStream *stream, const PacketSnapshotActor *actor);
+int packetReadSnapshotActor(BitStream *stream, PacketSnapshotActor *actor);
+
+/* input sequence, full state and falling speed */
+void packetWriteActorCorrection(BitStream *stream, const PacketServerActorCorrection *packet);
+int packetReadActorCorrection(BitStream *stream, PacketServerActorCorrection *packet);
+
+#endif /* SRVBIRTH_PACKET_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/
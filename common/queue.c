@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "queue.h"
+#include "types.h"
+
+#define IFDO(f, x) { if (x) f(x); x = NULL; }
+
+Queue* queueNew(size_t size, size_t elementSize)
+{
+   Queue *queue = NULL;
+   size_t n = 1;
+   assert(size && elementSize);
+
+   for (; n < size; n <<= 1);
+
+   if (!(queue = calloc(1, sizeof(Queue))))
+      goto fail;
+
+   if (!(queue->data = malloc(n * elementSize)))
+      goto fail;
+
+   atomic_init(&queue->head, 0);
+   atomic_init(&queue->tail, 0);
+   queue->mask = n - 1;
+   queue->elementSize = elementSize;
+   return queue;
+
+fail:
+   IFDO(free, queue);
+   return NULL;
+}
+
+void queueFree(Queue *queue)
+{
+   assert(queue);
+   free(queue->data);
+   free(queue);
+}
+
+int queuePush(Queue *queue, const void *element)
+{
+   size_t tail, head;
+   assert(queue && element);
+
+   tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+   head = atomic_load_explicit(&queue->head, memory_order_acquire);
+   if (tail - head > queue->mask)
+      return RETURN_FAIL;
+
+   memcpy(queue->data + (tail & queue->mask) * queue->elementSize, element, queue->elementSize);
+   atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+   return RETURN_OK;
+}
+
+int queuePop(Queue *queue, void *element)
+{
+   size_t tail, head;
+   assert(queue && element);
+
+   head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+   tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+   if (head == tail)
+      return RETURN_FAIL;
+
+   memcpy(element, queue->data + (head & queue->mask) * queue->elementSize, queue->elementSize);
+   atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+   return RETURN_OK;
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
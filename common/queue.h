@@ -0,0 +1,29 @@
+#ifndef SRVBIRTH_QUEUE_H
+#define SRVBIRTH_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Lock-free single producer, single consumer ring
+ * of fixed size elements. One thread pushes, one pops. */
+typedef struct Queue {
+   atomic_size_t head; /* owned by consumer */
+   char pad0[64 - sizeof(atomic_size_t)];
+   atomic_size_t tail; /* owned by producer */
+   char pad1[64 - sizeof(atomic_size_t)];
+   size_t mask;
+   size_t elementSize;
+   unsigned char *data;
+} Queue;
+
+/* size is rounded up to power of two */
+Queue* queueNew(size_t size, size_t elementSize);
+void queueFree(Queue *queue);
+
+/* RETURN_FAIL when full or empty */
+int queuePush(Queue *queue, const void *element);
+int queuePop(Queue *queue, void *element);
+
+#endif /* SRVBIRTH_QUEUE_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,53 @@
+#include <math.h>
+#include <assert.h>
+#include "sim.h"
+#include "types.h"
+
+static const Vector3fQuantization world = WORLD_QUANTIZATION;
+
+static float clampf(float v, float min, float max)
+{
+   return (v < min ? min : (v > max ? max : v));
+}
+
+float simRotation(unsigned char bams)
+{
+   return TODEGS(bams);
+}
+
+void simStep(SimState *state, unsigned char flags, float rotation)
+{
+   const float speed = SIM_SPEED * SIM_STEP * ((flags & ACTOR_SPRINT) ? SIM_SPRINT : 1.0f);
+   const float radians = (rotation + 90.0f) * (float)M_PI / 180.0f;
+   assert(state);
+
+   if (flags & ACTOR_JUMP) {
+      state->position.y += speed * SIM_JUMP;
+      state->fallingSpeed = 0.0f;
+   } else {
+      state->position.y -= state->fallingSpeed;
+      state->fallingSpeed += speed * SIM_FALL;
+   }
+
+   if (flags & ACTOR_FORWARD) {
+      state->position.x -= speed * cosf(radians);
+      state->position.z += speed * sinf(radians);
+   }
+
+   if (flags & ACTOR_BACKWARD) {
+      state->position.x += speed * cosf(radians);
+      state->position.z -= speed * sinf(radians);
+   }
+
+   if (state->position.y < SIM_GROUND) {
+      state->position.y = SIM_GROUND;
+      state->fallingSpeed = 0.0f;
+   }
+
+   /* keep inside what snapshots can carry */
+   state->position.x = clampf(state->position.x, world.x.min, world.x.max);
+   state->position.y = clampf(state->position.y, world.y.min, world.y.max);
+   state->position.z = clampf(state->position.z, world.z.min, world.z.max);
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,35 @@
+#ifndef SRVBIRTH_SIM_H
+#define SRVBIRTH_SIM_H
+
+#include "bams.h"
+
+/* Deterministic actor movement, shared by client and server.
+ * Runs in fixed steps, so the same inputs from the same state
+ * give the same result on both sides. */
+
+#define SIM_TICKRATE 30
+#define SIM_STEP (1.0f / SIM_TICKRATE) /* seconds */
+
+#define SIM_SPEED  30.0f  /* units per second */
+#define SIM_SPRINT 2.0f   /* speed multiplier with ACTOR_SPRINT */
+#define SIM_JUMP   8.0f   /* upward impulse, multiple of step speed */
+#define SIM_FALL   0.01f  /* falling speed gained each step, multiple of step speed */
+#define SIM_GROUND 0.0f
+
+/* movement state not carried by the input */
+typedef struct SimState {
+   Vector3f position;
+   float fallingSpeed;
+} SimState;
+
+/* advance state one step with input flags (ACTOR_*)
+ * and rotation in degrees */
+void simStep(SimState *state, unsigned char flags, float rotation);
+
+/* rotation as it goes to the wire and back, use for inputs
+ * so both sides step with the exact same value */
+float simRotation(unsigned char bams);
+
+#endif /* SRVBIRTH_SIM_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/
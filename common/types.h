@@ -21,13 +21,55 @@ enum {
    ACTOR_SPRINT      = 64,
 };
 
+/* bits actor flags take on the wire */
+#define ACTOR_FLAGS_BITS 7
+
+/* World bounds positions are quantized against on the wire.
+ * 1/32 unit precision horizontally and 1/8 vertically. */
+#define WORLD_QUANTIZATION {        \
+   { -512.0f, 512.0f, 15 },         \
+   {  -32.0f, 224.0f, 11 },         \
+   { -512.0f, 512.0f, 15 } }
+
+/* Falling speed in units per simulation step */
+#define FALL_QUANTIZATION { 0.0f, 16.0f, 12 }
+
 typedef enum PacketId {
-   PACKET_ID_CLIENT_INFORMATION  = 0,
-   PACKET_ID_CLIENT_PART         = 1,
+   PACKET_ID_ROSTER              = 0,
    PACKET_ID_ACTOR_STATE         = 2,
-   PACKET_ID_ACTOR_FULL_STATE    = 4
+   PACKET_ID_ACTOR_FULL_STATE    = 4,
+   PACKET_ID_SNAPSHOT            = 5,
+   PACKET_ID_SNAPSHOT_ACK        = 6,
+   PACKET_ID_ACTOR_CORRECTION    = 7,
+   PACKET_ID_LAST /* amount of packet ids, keep last */
 } PacketId;
 
+/* enet channels, reliable control traffic
+ * never waits behind state that is fine to lose */
+enum {
+   CHANNEL_CONTROL = 0, /* reliable: join, part */
+   CHANNEL_STATE   = 1, /* unreliable: inputs, snapshots, corrections */
+   CHANNEL_COUNT
+};
+
+/* inputs repeated in every ActorState packet */
+#define ACTOR_INPUT_REDUNDANCY 4
+
+/* amount of snapshots kept around as delta baselines */
+#define SNAPSHOT_HISTORY 32
+#define SNAPSHOT_HISTORY_BITS 5
+
+/* fields a snapshot entry carries */
+enum {
+   SNAPSHOT_FLAGS       = 1,
+   SNAPSHOT_ROTATION    = 2,
+   SNAPSHOT_POSITION_X  = 4,
+   SNAPSHOT_POSITION_Y  = 8,
+   SNAPSHOT_POSITION_Z  = 16,
+   SNAPSHOT_ALL         = 31
+};
+#define SNAPSHOT_MASK_BITS 5
+
 /* Server will send PacketServer<packet name> packets,
  * and recieves Packet<packet name> packets.
  *
@@ -60,16 +102,78 @@ typedef enum PacketId {
 DEFINE_PACKET(Generic, ;);
 
 /* server only packets */
+/* Actors that entered and left the client's view since the last roster,
+ * sent reliably at most once per tick. Header is followed by enter and
+ * then leave clientIds, 32 bits each in network order. Entering actors
+ * get their full state in the next snapshot.
+ *
+ * clientId of the header is unused. */
+typedef struct {
+   PACKET_SERVER_HEADER
+   unsigned short enter; /* network order */
+   unsigned short leave; /* network order */
+} PacketServerRoster;
+
+/* Snapshot of actors, sent once per server tick.
+ * Header is followed by count bit packed PacketSnapshotActor entries,
+ * see packet.h for the wire format.
+ *
+ * Each entry is a delta against the actor's state at tick - base,
+ * which the client has acknowledged, or against nothing if base is 0.
+ * Only the fields set in mask are present.
+ *
+ * time is the server clock at the tick in milliseconds,
+ * clients use it to play the snapshots back evenly.
+ *
+ * clientId of the header is unused. */
 typedef struct {
    PACKET_SERVER_HEADER
-   char host[45];
-} PacketServerClientInformation;
-typedef PacketServerGeneric PacketServerClientPart;
+   unsigned int tick;
+   unsigned int time;
+   unsigned char count;
+} PacketServerSnapshot;
+
+typedef struct {
+   unsigned int clientId;
+   unsigned char base;
+   unsigned char mask;
+   unsigned char flags;
+   unsigned char rotation;
+   Vector3f position;
+} PacketSnapshotActor;
+
+/* Authoritative state of the receiving client's own actor,
+ * after the simulation step with input sequence number sequence.
+ * Body is bit packed, see packet.h for the wire format. */
+typedef struct {
+   PACKET_SERVER_HEADER
+   unsigned short sequence;
+   unsigned char flags;
+   unsigned char rotation;
+   Vector3f position;
+   float fallingSpeed;
+} PacketServerActorCorrection;
+
+/* client only packets */
+typedef struct {
+   PACKET_CLIENT_HEADER
+   unsigned int tick;
+} PacketSnapshotAck;
+
+/* input of a client, sequence is the client's simulation
+ * step this input was first used on, in network byte order */
+typedef struct {
+   unsigned char flags;
+   unsigned char rotation;
+   unsigned short sequence;
+} ActorInput;
 
 /* client<->server packets */
+/* Latest inputs of the sender, sent at a fixed rate.
+ * Header is followed by count ActorInputs, newest first,
+ * so any of the next few packets covers for a lost one. */
 DEFINE_PACKET(ActorState,
-      unsigned char flags;
-      unsigned char rotation;);
+      unsigned char count;);
 
 DEFINE_PACKET(ActorFullState,
       unsigned char flags;
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <enet/enet.h>
+
+#include "../common/bams.h"
+#include "../common/types.h"
+#include "../common/packet.h"
+#include "../common/log.h"
+
+/* Headless load generator.
+ * Drives many bot peers against the server from one process,
+ * bots behave like the client's bot mode: run forward attacking,
+ * and pick a new turn direction every second.
+ *
+ * Configured with environment variables:
+ *   SRVBIRTH_SERVER            server host (localhost)
+ *   SRVBIRTH_LOADGEN_PEERS     amount of bots (1000)
+ *   SRVBIRTH_LOADGEN_RATE      state packets per second per bot (10)
+ *   SRVBIRTH_LOADGEN_FULLSTATE percentage of ActorFullState packets (10)
+ *   SRVBIRTH_LOADGEN_RAMP      new connections per second (200)
+ *   SRVBIRTH_LOADGEN_DURATION  seconds to run, 0 runs until interrupted (0) */
+
+/* enet host per this many peers, each gets its own socket
+ * so the server's reuseport shards see distinct addresses */
+#define LOADGEN_PEERS_PER_HOST 256
+#define LOADGEN_MAX_PEERS 65536
+
+/* simulation step of the bots, in milliseconds */
+#define LOADGEN_STEP 10
+
+/* stats interval, in milliseconds */
+#define LOADGEN_REPORT_INTERVAL 5000
+
+/* same as the client */
+#define BOT_SPEED 30.0f
+#define BOT_TURN_SPEED 180.0f
+#define BOT_TURN_INTERVAL 1000
+
+typedef struct Bot {
+   ENetPeer *peer;
+   unsigned char flags;
+   unsigned char turn; /* ACTOR_LEFT, ACTOR_RIGHT or none */
+   float rotation; /* degrees */
+   Vector3f position;
+   enet_uint32 nextTurn;
+   enet_uint32 nextSend;
+   unsigned short sequence; /* server drops inputs that aren't newer */
+   ActorInput inputs[ACTOR_INPUT_REDUNDANCY]; /* sent ones, newest first */
+   unsigned int numInputs;
+} Bot;
+
+typedef struct LoadStats {
+   unsigned long connects, disconnects;
+   unsigned long states, fullStates, acks;
+   unsigned long packetsIn, bytesIn;
+} LoadStats;
+
+typedef struct LoadData {
+   ENetHost **hosts;
+   unsigned int numHosts;
+   Bot *bots;
+   unsigned int numBots, numStarted;
+   unsigned int rate, fullState, ramp;
+   ENetAddress address;
+   LoadStats stats;
+} LoadData;
+
+static const Vector3fQuantization world = WORLD_QUANTIZATION;
+static volatile sig_atomic_t RUNNING = 1;
+
+static void sigint(int sig)
+{
+   (void)sig;
+   RUNNING = 0;
+}
+
+static unsigned int envInt(const char *name, unsigned int def)
+{
+   const char *value;
+   if (!(value = getenv(name)) || atoi(value) < 0)
+      return def;
+   return atoi(value);
+}
+
+static void botSend(Bot *bot, unsigned char *pdata, size_t size, ENetPacketFlag flag)
+{
+   ENetPacket *packet;
+   if (!(packet = enet_packet_create(pdata, size, flag)))
+      return;
+   if (enet_peer_send(bot->peer, (flag & ENET_PACKET_FLAG_RELIABLE ? CHANNEL_CONTROL : CHANNEL_STATE), packet) != 0)
+      enet_packet_destroy(packet);
+}
+
+static void botSendState(LoadData *data, Bot *bot)
+{
+   unsigned char pdata[sizeof(PacketActorState) + ACTOR_INPUT_REDUNDANCY * sizeof(ActorInput)];
+   PacketActorState *state = (PacketActorState*)pdata;
+
+   /* repeat the last few like the client does */
+   memmove(bot->inputs + 1, bot->inputs, (ACTOR_INPUT_REDUNDANCY - 1) * sizeof(ActorInput));
+   bot->inputs[0].flags = bot->flags;
+   bot->inputs[0].rotation = (int)TOBAMS(bot->rotation) & 0xff;
+   bot->inputs[0].sequence = htons(++bot->sequence);
+   if (bot->numInputs < ACTOR_INPUT_REDUNDANCY) bot->numInputs++;
+
+   state->id = PACKET_ID_ACTOR_STATE;
+   state->count = bot->numInputs;
+   memcpy(pdata + sizeof(PacketActorState), bot->inputs, bot->numInputs * sizeof(ActorInput));
+   botSend(bot, pdata, sizeof(PacketActorState) + bot->numInputs * sizeof(ActorInput), 0);
+   data->stats.states++;
+}
+
+static void botSendFullState(LoadData *data, Bot *bot)
+{
+   BitStream stream;
+   PacketActorFullState state;
+   unsigned char pdata[sizeof(PacketGeneric) + PACKET_ACTOR_FULL_STATE_SIZE];
+
+   memset(&state, 0, sizeof(PacketActorFullState));
+   state.id = PACKET_ID_ACTOR_FULL_STATE;
+   state.flags = bot->flags;
+   state.rotation = (int)TOBAMS(bot->rotation) & 0xff;
+   memcpy(&state.position, &bot->position, sizeof(Vector3f));
+
+   pdata[0] = state.id;
+   bitStreamInit(&stream, pdata + sizeof(PacketGeneric), PACKET_ACTOR_FULL_STATE_SIZE);
+   packetWriteActorFullState(&stream, &state);
+   botSend(bot, pdata, sizeof(PacketGeneric) + bitStreamBytes(&stream), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+   data->stats.fullStates++;
+}
+
+static float clampf(float v, float min, float max)
+{
+   return (v < min ? min : (v > max ? max : v));
+}
+
+/* bot mode of the client, without the camera */
+static void botUpdate(LoadData *data, Bot *bot, enet_uint32 now, float delta)
+{
+   const float speed = BOT_SPEED * delta;
+
+   if (ENET_TIME_GREATER_EQUAL(now, bot->nextTurn)) {
+      bot->turn = 0;
+      if (rand() % 2 == 0)
+         bot->turn = ACTOR_RIGHT;
+      else if (rand() % 2 == 0)
+         bot->turn = ACTOR_LEFT;
+      bot->nextTurn = now + BOT_TURN_INTERVAL;
+   }
+
+   bot->flags = ACTOR_FORWARD | ACTOR_ATTACK;
+   if (bot->turn == ACTOR_LEFT) bot->rotation += BOT_TURN_SPEED * delta;
+   if (bot->turn == ACTOR_RIGHT) bot->rotation -= BOT_TURN_SPEED * delta;
+   bot->rotation = fmodf(bot->rotation + 360.0f, 360.0f);
+
+   /* stay inside what the wire can carry */
+   bot->position.x -= speed * cosf((bot->rotation + 90.0f) * M_PI / 180.0f);
+   bot->position.z += speed * sinf((bot->rotation + 90.0f) * M_PI / 180.0f);
+   bot->position.x = clampf(bot->position.x, world.x.min, world.x.max - 1.0f);
+   bot->position.z = clampf(bot->position.z, world.z.min, world.z.max - 1.0f);
+
+   if (!data->rate || !ENET_TIME_GREATER_EQUAL(now, bot->nextSend))
+      return;
+
+   if ((unsigned int)(rand() % 100) < data->fullState) botSendFullState(data, bot);
+   else botSendState(data, bot);
+   bot->nextSend = now + 1000 / data->rate;
+}
+
+static void botAck(LoadData *data, Bot *bot, ENetPacket *packet)
+{
+   PacketSnapshotAck ack;
+   PacketServerSnapshot *snapshot = (PacketServerSnapshot*)packet->data;
+
+   if (packet->dataLength < sizeof(PacketServerSnapshot))
+      return;
+
+   /* entries are not decoded, acking keeps server on delta baselines */
+   memset(&ack, 0, sizeof(PacketSnapshotAck));
+   ack.id = PACKET_ID_SNAPSHOT_ACK;
+   ack.tick = snapshot->tick;
+   botSend(bot, (unsigned char*)&ack, sizeof(PacketSnapshotAck), ENET_PACKET_FLAG_UNSEQUENCED);
+   data->stats.acks++;
+}
+
+static void serviceHost(LoadData *data, ENetHost *host)
+{
+   ENetEvent event;
+   Bot *bot;
+
+   while (enet_host_service(host, &event, 0) > 0) {
+      bot = (Bot*)event.peer->data;
+      switch (event.type) {
+         case ENET_EVENT_TYPE_CONNECT:
+            data->stats.connects++;
+            break;
+
+         case ENET_EVENT_TYPE_RECEIVE:
+            data->stats.packetsIn++;
+            data->stats.bytesIn += event.packet->dataLength;
+            if (bot && event.packet->dataLength > 0 &&
+                ((PacketServerGeneric*)event.packet->data)->id == PACKET_ID_SNAPSHOT)
+               botAck(data, bot, event.packet);
+            enet_packet_destroy(event.packet);
+            break;
+
+         case ENET_EVENT_TYPE_DISCONNECT:
+            data->stats.disconnects++;
+            if (bot) bot->peer = NULL;
+            event.peer->data = NULL;
+            break;
+
+         case ENET_EVENT_TYPE_NONE:
+            break;
+      }
+   }
+}
+
+static int initLoad(LoadData *data, const char *host_ip)
+{
+   unsigned int i;
+   assert(data && host_ip);
+
+   memset(data, 0, sizeof(LoadData));
+   data->numBots = envInt("SRVBIRTH_LOADGEN_PEERS", 1000);
+   data->rate = envInt("SRVBIRTH_LOADGEN_RATE", 10);
+   data->fullState = envInt("SRVBIRTH_LOADGEN_FULLSTATE", 10);
+   data->ramp = envInt("SRVBIRTH_LOADGEN_RAMP", 200);
+   if (data->numBots > LOADGEN_MAX_PEERS) data->numBots = LOADGEN_MAX_PEERS;
+   if (data->fullState > 100) data->fullState = 100;
+   if (data->rate > 1000) data->rate = 1000;
+   if (!data->ramp) data->ramp = 1;
+
+   enet_address_set_host(&data->address, host_ip);
+   data->address.port = 1234;
+
+   data->numHosts = (data->numBots + LOADGEN_PEERS_PER_HOST - 1) / LOADGEN_PEERS_PER_HOST;
+   if (!(data->bots = calloc(data->numBots, sizeof(Bot))) ||
+       !(data->hosts = calloc(data->numHosts, sizeof(ENetHost*))))
+      return RETURN_FAIL;
+
+   for (i = 0; i != data->numHosts; ++i) {
+      if (!(data->hosts[i] = enet_host_create(NULL, LOADGEN_PEERS_PER_HOST, CHANNEL_COUNT, 0, 0))) {
+         LOG_E("An error occurred while trying to create an ENet client host.");
+         return RETURN_FAIL;
+      }
+
+      /* same as the client */
+      data->hosts[i]->checksum = enet_crc32;
+      enet_host_compress_with_range_coder(data->hosts[i]);
+   }
+
+   return RETURN_OK;
+}
+
+static void deinitLoad(LoadData *data)
+{
+   unsigned int i;
+   assert(data);
+
+   for (i = 0; i != data->numBots; ++i)
+      if (data->bots[i].peer) enet_peer_disconnect_now(data->bots[i].peer, 0);
+
+   for (i = 0; i != data->numHosts; ++i)
+      if (data->hosts[i]) enet_host_destroy(data->hosts[i]);
+
+   free(data->hosts);
+   free(data->bots);
+   memset(data, 0, sizeof(LoadData));
+}
+
+/* connect up to count more bots */
+static void startBots(LoadData *data, unsigned int count, enet_uint32 now)
+{
+   Bot *bot;
+
+   for (; count && data->numStarted < data->numBots; --count) {
+      bot = &data->bots[data->numStarted];
+      if (!(bot->peer = enet_host_connect(data->hosts[data->numStarted / LOADGEN_PEERS_PER_HOST], &data->address, CHANNEL_COUNT, 0)))
+         return;
+
+      bot->peer->data = bot;
+      bot->rotation = rand() % 360;
+      bot->position.x = world.x.min + rand() % (int)(world.x.max - world.x.min);
+      bot->position.z = world.z.min + rand() % (int)(world.z.max - world.z.min);
+      bot->nextTurn = now;
+      bot->nextSend = now + (data->rate ? rand() % (1000 / data->rate) : 0);
+      data->numStarted++;
+   }
+}
+
+static void report(LoadData *data, LoadStats *last, enet_uint32 elapsed)
+{
+   LoadStats *s = &data->stats;
+   const float seconds = elapsed / 1000.0f;
+
+   LOG_I("peers %u/%u connected, %lu disconnected | out: %.0f state/s %.0f full/s %.0f ack/s | in: %.0f pkt/s %.0f KiB/s",
+         (unsigned int)(s->connects - s->disconnects), data->numBots, s->disconnects,
+         (s->states - last->states) / seconds, (s->fullStates - last->fullStates) / seconds,
+         (s->acks - last->acks) / seconds, (s->packetsIn - last->packetsIn) / seconds,
+         (s->bytesIn - last->bytesIn) / 1024.0f / seconds);
+   memcpy(last, s, sizeof(LoadStats));
+}
+
+int main(void)
+{
+   LoadData data;
+   LoadStats last;
+   unsigned int i, duration;
+   enet_uint32 now, start, lastStep, lastReport, lastRamp;
+   const struct timespec step = { 0, LOADGEN_STEP * 1000000L };
+   const char *host = getenv("SRVBIRTH_SERVER");
+   if (!host) host = "localhost";
+
+   logInit();
+   if (enet_initialize() != 0) {
+      LOG_E("An error occurred while initializing ENet.");
+      logDeinit();
+      return EXIT_FAILURE;
+   }
+
+   if (initLoad(&data, host) != RETURN_OK) {
+      deinitLoad(&data);
+      enet_deinitialize();
+      logDeinit();
+      return EXIT_FAILURE;
+   }
+
+   duration = envInt("SRVBIRTH_LOADGEN_DURATION", 0) * 1000;
+   signal(SIGINT, sigint);
+   signal(SIGTERM, sigint);
+   srand(time(NULL));
+
+   LOG_I("Driving %u bots against %s:1234 from %u hosts, %u state/s each, %u%% full states.",
+         data.numBots, host, data.numHosts, data.rate, data.fullState);
+
+   memset(&last, 0, sizeof(LoadStats));
+   start = lastStep = lastReport = lastRamp = enet_time_get();
+   while (RUNNING) {
+      now = enet_time_get();
+      if (duration && ENET_TIME_DIFFERENCE(now, start) >= duration)
+         break;
+
+      /* ramp up connections instead of flooding the server */
+      if (data.numStarted < data.numBots && ENET_TIME_DIFFERENCE(now, lastRamp) >= 100) {
+         startBots(&data, (data.ramp + 9) / 10, now);
+         lastRamp = now;
+      }
+
+      for (i = 0; i != data.numHosts; ++i)
+         serviceHost(&data, data.hosts[i]);
+
+      for (i = 0; i != data.numStarted; ++i) {
+         if (!data.bots[i].peer || data.bots[i].peer->state != ENET_PEER_STATE_CONNECTED) continue;
+         botUpdate(&data, &data.bots[i], now, ENET_TIME_DIFFERENCE(now, lastStep) / 1000.0f);
+      }
+      lastStep = now;
+
+      for (i = 0; i != data.numHosts; ++i)
+         enet_host_flush(data.hosts[i]);
+
+      if (ENET_TIME_DIFFERENCE(now, lastReport) >= LOADGEN_REPORT_INTERVAL) {
+         report(&data, &last, ENET_TIME_DIFFERENCE(now, lastReport));
+         lastReport = now;
+      }
+
+      nanosleep(&step, NULL);
+   }
+
+   report(&data, &last, ENET_TIME_DIFFERENCE(enet_time_get(), lastReport) + 1);
+   deinitLoad(&data);
+   enet_deinitialize();
+   logDeinit();
+   return EXIT_SUCCESS;
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../common/types.h"
+#include "journal.h"
+
+#define JOURNAL_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+static uint64_t journalNow(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* map the window of the file where size more bytes go */
+static int journalReserve(Journal *journal, size_t size)
+{
+   size_t offset, length;
+   const size_t page = sysconf(_SC_PAGESIZE);
+
+   if (journal->map && journal->used + size <= journal->mapOffset + journal->mapSize)
+      return RETURN_OK;
+
+   if (journal->map)
+      munmap(journal->map, journal->mapSize);
+   journal->map = NULL;
+
+   offset = journal->used / page * page;
+   length = JOURNAL_CHUNK;
+   if (journal->used - offset + size > length)
+      length = (journal->used - offset + size + page - 1) / page * page;
+
+   if (ftruncate(journal->fd, offset + length) != 0)
+      return RETURN_FAIL;
+
+   if ((journal->map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, offset)) == MAP_FAILED) {
+      journal->map = NULL;
+      return RETURN_FAIL;
+   }
+
+   journal->mapOffset = offset;
+   journal->mapSize = length;
+   return RETURN_OK;
+}
+
+static int journalAppend(Journal *journal, const void *data, size_t size)
+{
+   if (journalReserve(journal, size) != RETURN_OK)
+      return RETURN_FAIL;
+
+   memcpy(journal->map + journal->used - journal->mapOffset, data, size);
+   journal->used += size;
+   return RETURN_OK;
+}
+
+Journal* journalNew(const char *path, const JournalHeader *header)
+{
+   Journal *journal;
+   JournalHeader copy;
+   assert(path && header);
+
+   if (!(journal = calloc(1, sizeof(Journal))))
+      return NULL;
+
+   journal->fd = -1;
+
+   if ((journal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+      goto fail;
+
+   memcpy(&copy, header, sizeof(JournalHeader));
+   copy.magic = JOURNAL_MAGIC;
+   copy.version = JOURNAL_VERSION;
+   if (journalAppend(journal, &copy, sizeof(JournalHeader)) != RETURN_OK)
+      goto fail;
+
+   journal->started = journalNow();
+   return journal;
+
+fail:
+   journalFree(journal);
+   return NULL;
+}
+
+void journalFree(Journal *journal)
+{
+   assert(journal);
+
+   if (journal->map)
+      munmap(journal->map, journal->mapSize);
+
+   /* drop the unused tail of the last chunk */
+   if (journal->fd >= 0) {
+      if (ftruncate(journal->fd, journal->used) != 0) {}
+      close(journal->fd);
+   }
+
+   free(journal);
+}
+
+int journalWrite(Journal *journal, JournalType type, uint16_t peer, uint32_t connectID, uint8_t channel,
+      const void *payload, size_t size)
+{
+   JournalRecord *record;
+   const size_t total = JOURNAL_ALIGN(sizeof(JournalRecord) + size);
+   assert(journal && (payload || !size));
+
+   /* record is written in place, whole or not at all */
+   if (journalReserve(journal, total) != RETURN_OK)
+      return RETURN_FAIL;
+
+   record = (JournalRecord*)(journal->map + journal->used - journal->mapOffset);
+   memset(record, 0, total);
+   record->time = journalNow() - journal->started;
+   record->size = size;
+   record->connectID = connectID;
+   record->peer = peer;
+   record->type = type;
+   record->channel = channel;
+   if (size) memcpy(record + 1, payload, size);
+   journal->used += total;
+   return RETURN_OK;
+}
+
+JournalReader* journalOpen(const char *path)
+{
+   struct stat st;
+   JournalReader *reader;
+   assert(path);
+
+   if (!(reader = calloc(1, sizeof(JournalReader))))
+      return NULL;
+
+   reader->fd = -1;
+
+   if ((reader->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(reader->fd, &st) != 0)
+      goto fail;
+
+   if ((size_t)st.st_size < sizeof(JournalHeader))
+      goto fail;
+
+   reader->size = st.st_size;
+   if ((reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0)) == MAP_FAILED) {
+      reader->map = NULL;
+      goto fail;
+   }
+
+   memcpy(&reader->header, reader->map, sizeof(JournalHeader));
+   if (reader->header.magic != JOURNAL_MAGIC || reader->header.version != JOURNAL_VERSION)
+      goto fail;
+
+   reader->offset = sizeof(JournalHeader);
+   return reader;
+
+fail:
+   journalClose(reader);
+   return NULL;
+}
+
+void journalClose(JournalReader *reader)
+{
+   assert(reader);
+   if (reader->map) munmap((void*)reader->map, reader->size);
+   if (reader->fd >= 0) close(reader->fd);
+   free(reader);
+}
+
+int journalNext(JournalReader *reader, const JournalRecord **record, const unsigned char **payload)
+{
+   const JournalRecord *r;
+   assert(reader && record && payload);
+
+   /* end, or a record cut short by a crash */
+   if (reader->offset + sizeof(JournalRecord) > reader->size)
+      return RETURN_FAIL;
+
+   r = (const JournalRecord*)(reader->map + reader->offset);
+   if (!r->type || r->size > reader->size - reader->offset - sizeof(JournalRecord))
+      return RETURN_FAIL;
+
+   *record = r;
+   *payload = (const unsigned char*)(r + 1);
+   reader->offset += JOURNAL_ALIGN(sizeof(JournalRecord) + r->size);
+   return RETURN_OK;
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,72 @@
+#ifndef SRVBIRTH_JOURNAL_H
+#define SRVBIRTH_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only record of everything a shard received, for replaying
+ * production traffic offline. The file starts with a JournalHeader,
+ * followed by records. Each record is a JournalRecord and size bytes
+ * of payload, padded to 8 bytes. Host byte order throughout. */
+
+#define JOURNAL_MAGIC   0x4a425253 /* "SRBJ" */
+#define JOURNAL_VERSION 1
+
+/* file is grown and mapped this much at a time */
+#define JOURNAL_CHUNK (16 * 1024 * 1024)
+
+/* 0 is the zero filled space after the last record */
+typedef enum JournalType {
+   JOURNAL_CONNECT = 1, /* payload: ENetAddress of the peer */
+   JOURNAL_RECEIVE,     /* payload: packet data */
+   JOURNAL_DISCONNECT,
+   JOURNAL_SHARD,       /* payload: source shard (uint32_t) and message */
+   JOURNAL_TICK,
+} JournalType;
+
+typedef struct JournalHeader {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t shard, numShards;
+   int64_t tickInterval; /* nanoseconds */
+} JournalHeader;
+
+typedef struct JournalRecord {
+   uint64_t time; /* microseconds since the journal was started */
+   uint32_t size; /* payload bytes */
+   uint32_t connectID;
+   uint16_t peer; /* incomingPeerID */
+   uint8_t type;
+   uint8_t channel;
+   uint32_t reserved;
+} JournalRecord;
+
+typedef struct Journal {
+   int fd;
+   unsigned char *map;
+   size_t mapOffset, mapSize; /* window of the file that is mapped */
+   size_t used; /* bytes written */
+   uint64_t started;
+} Journal;
+
+typedef struct JournalReader {
+   int fd;
+   const unsigned char *map;
+   size_t size, offset;
+   JournalHeader header;
+} JournalReader;
+
+/* recording, one journal per thread */
+Journal* journalNew(const char *path, const JournalHeader *header);
+void journalFree(Journal *journal);
+int journalWrite(Journal *journal, JournalType type, uint16_t peer, uint32_t connectID, uint8_t channel,
+      const void *payload, size_t size);
+
+/* replaying, payload points into the mapped file */
+JournalReader* journalOpen(const char *path);
+void journalClose(JournalReader *reader);
+int journalNext(JournalReader *reader, const JournalRecord **record, const unsigned char **payload);
+
+#endif /* SRVBIRTH_JOURNAL_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -1,97 +1,462 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* accept4 */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <enet/enet.h>
 
 #include "../common/bams.h"
 #include "../common/types.h"
+#include "../common/packet.h"
+#include "../common/queue.h"
+#include "../common/log.h"
+#include "../common/sim.h"
+#include "metrics.h"
+#include "journal.h"
 
-typedef struct GameActor {
-   unsigned char flags;
-   unsigned char rotation;
-   Vector3f position;
-} GameActor;
+/* maximum amount of simultaneous clients per shard */
+#define SERVER_MAX_CLIENTS 256
+
+/* size of the slot table, local clients use the first
+ * SERVER_MAX_CLIENTS slots, actors of other shards the rest */
+#define SERVER_MAX_ACTORS 2048
+
+/* maximum amount of worker threads, each owns a shard.
+ * defaults to cpu count, override with SRVBIRTH_WORKERS environment variable */
+#define SERVER_MAX_SHARDS 64
+
+/* states in flight between two shards, a few ticks of updates for
+ * every local client. halved towards SHARD_QUEUE_MIN while the queues
+ * of all shard pairs do not fit the memory budget */
+#define SHARD_QUEUE_SIZE (SERVER_MAX_CLIENTS * 4)
+#define SHARD_QUEUE_MIN (SERVER_MAX_CLIENTS * 2)
+
+/* joins and parts in flight between two shards,
+ * what does not fit is sent on a later tick */
+#define SHARD_CONTROL_QUEUE_SIZE SERVER_MAX_CLIENTS
+
+/* MiB for shard state and queues, the shard count is clamped to fit,
+ * override with SRVBIRTH_MEMORY_BUDGET environment variable */
+#define SERVER_DEFAULT_MEMORY_BUDGET 256
+
+/* stats endpoint, override with SRVBIRTH_STATS_SOCKET environment variable */
+#define SERVER_DEFAULT_STATS_SOCKET "/tmp/srvbirth-stats.sock"
+
+/* periodic stats dump, override with SRVBIRTH_STATS_FILE and
+ * SRVBIRTH_STATS_INTERVAL (seconds, 0 disables) environment variables */
+#define SERVER_DEFAULT_STATS_FILE "srvbirth-stats.txt"
+#define SERVER_DEFAULT_STATS_INTERVAL 10
+
+/* default server tick rate in hz,
+ * override with SRVBIRTH_TICKRATE environment variable */
+#define SERVER_DEFAULT_TICKRATE 30
+
+/* bytes per second of snapshots each peer may receive,
+ * override with SRVBIRTH_PEER_BANDWIDTH environment variable */
+#define SERVER_DEFAULT_PEER_BANDWIDTH 65536
+
+/* smallest per tick snapshot budget, throttling never starves a peer */
+#define SERVER_MIN_BUDGET 64
+
+/* encoded snapshot entries cached per actor and tick,
+ * one for each distinct baseline clients are on */
+#define SNAPSHOT_CACHE_SIZE 4
+
+/* bitset of actor slots */
+#define SERVER_SLOT_WORDS ((SERVER_MAX_ACTORS + 31) / 32)
+#define SLOT_SET(bits, s)    ((bits)[(s) / 32] |= 1u << ((s) % 32))
+#define SLOT_CLEAR(bits, s)  ((bits)[(s) / 32] &= ~(1u << ((s) % 32)))
+#define SLOT_IS_SET(bits, s) ((bits)[(s) / 32] & (1u << ((s) % 32)))
+
+/* bitset of local client slots */
+#define SERVER_CLIENT_WORDS ((SERVER_MAX_CLIENTS + 31) / 32)
+
+/* uniform grid over the world bounds for interest management */
+#define SERVER_GRID_CELL_SIZE 64.0f
+#define SERVER_GRID_SIZE      16 /* cells per axis */
+
+/* ticks between corrections sent to each client about its own actor */
+#define SERVER_CORRECTION_INTERVAL 6
+
+/* inputs received ahead of the simulation, per client */
+#define SERVER_INPUT_QUEUE 16
+
+/* steps an input may wait for the step the client started it on,
+ * past this we have fallen behind the client and switch right away */
+#define SERVER_INPUT_SLACK 4
+
+/* roster changes batched per client, flushed early if more happen in a tick */
+#define SERVER_ROSTER_SIZE 256
+
+/* area of interest radius, actors enter at ENTER
+ * and leave at LEAVE to avoid flapping on the edge */
+#define SERVER_AOI_ENTER 96.0f
+#define SERVER_AOI_LEAVE 128.0f
+
+/* snapshot priority gained per tick, nearby actors gain up to
+ * NEAR more, actors the client has no state for NEW more */
+#define SERVER_PRIORITY_BASE 1.0f
+#define SERVER_PRIORITY_NEAR 4.0f
+#define SERVER_PRIORITY_NEW  8.0f
+
+static const Vector3fQuantization world = WORLD_QUANTIZATION;
+
+/* actor state as structure of arrays,
+ * indexed by the actor slot. */
+typedef struct GameActors {
+   unsigned char flags[SERVER_MAX_ACTORS];
+   unsigned char rotation[SERVER_MAX_ACTORS];
+   Vector3f position[SERVER_MAX_ACTORS];
+} GameActors;
+
+/* what a connected peer knows about the world */
+typedef struct ClientView {
+   /* tick of the actor state this client has acknowledged, per slot. 0 = none */
+   unsigned int acked[SERVER_MAX_ACTORS];
+
+   /* slots included in the snapshots we sent */
+   unsigned int sentTick[SNAPSHOT_HISTORY];
+   unsigned int sent[SNAPSHOT_HISTORY][SERVER_SLOT_WORDS];
+
+   /* slots this client is subscribed to */
+   unsigned int interest[SERVER_SLOT_WORDS];
+
+   /* accumulated snapshot priority per slot, reset when sent */
+   float priority[SERVER_MAX_ACTORS];
+
+   /* clientIds for the next roster, enters from the front, leaves from the back */
+   unsigned int roster[SERVER_ROSTER_SIZE];
+   unsigned int numEnter, numLeave;
+
+   /* client's simulation step numbering, valid once hasInput is set */
+   int hasInput;
+   unsigned short inputSequence; /* first step of current input */
+   unsigned short sequence;      /* step we simulated last */
+
+   /* received inputs not simulated yet, oldest first, sequence in host order */
+   ActorInput inputs[SERVER_INPUT_QUEUE];
+   unsigned int numInputs;
+   int hasReceived;
+   unsigned short lastReceived; /* newest input sequence received */
+} ClientView;
 
 typedef struct Client {
    char host[46];
    unsigned int clientId;
-   ENetPeer *peer;
-   GameActor actor;
-   struct Client *next;
+   unsigned int slot;
+   unsigned int activeIndex;
+   ENetPeer *peer;   /* NULL for actors of other shards */
+   ClientView *view; /* NULL for actors of other shards */
 } Client;
 
+/* actor events relayed between shards */
+typedef enum ShardMessageType {
+   SHARD_JOIN,
+   SHARD_STATE,
+   SHARD_PART,
+} ShardMessageType;
+
+typedef struct ShardMessage {
+   unsigned char type;
+   unsigned char flags;
+   unsigned char rotation;
+   unsigned short slot; /* slot in the sending shard */
+   unsigned int clientId;
+   Vector3f position;
+   char host[46]; /* only with SHARD_JOIN */
+} ShardMessage;
+
+/* SHARD_STATE as queued, sent every tick so kept small */
+typedef struct ShardState {
+   unsigned char flags;
+   unsigned char rotation;
+   unsigned short slot;
+   unsigned int clientId;
+   Vector3f position;
+} ShardState;
+
+/* slots bucketed by grid cell, as intrusive lists */
+typedef struct SpatialGrid {
+   int head[SERVER_GRID_SIZE * SERVER_GRID_SIZE];
+   int next[SERVER_MAX_ACTORS];
+   int prev[SERVER_MAX_ACTORS];
+   int cell[SERVER_MAX_ACTORS]; /* -1 when not in grid */
+} SpatialGrid;
+
+/* snapshot entries encoded this tick */
+typedef struct SnapshotCache {
+   unsigned int count[SERVER_MAX_ACTORS];
+   unsigned int base[SERVER_MAX_ACTORS][SNAPSHOT_CACHE_SIZE];
+   unsigned int offset[SERVER_MAX_ACTORS][SNAPSHOT_CACHE_SIZE];
+   unsigned char size[SERVER_MAX_ACTORS][SNAPSHOT_CACHE_SIZE];
+   unsigned char data[SERVER_MAX_ACTORS * SNAPSHOT_CACHE_SIZE * PACKET_SNAPSHOT_ACTOR_SIZE];
+   size_t used;
+} SnapshotCache;
+
+/* snapshot entry waiting for budget */
+typedef struct SnapshotCandidate {
+   float priority;
+   unsigned int slot;
+} SnapshotCandidate;
+
+/* Each worker thread owns one shard: an enet host on the shared port,
+ * and its own copy of the world. Local actors are published to the
+ * other shards through single producer, single consumer queues. */
 typedef struct ServerData {
    ENetHost *server;
-   Client *clients;
+   pthread_t thread;
+   unsigned int shard, numShards;
+   Queue *inbox[SERVER_MAX_SHARDS];  /* states from shard i, NULL for ourself */
+   Queue *outbox[SERVER_MAX_SHARDS]; /* states to shard i, NULL for ourself */
+   Queue *controlIn[SERVER_MAX_SHARDS];  /* joins and parts from shard i */
+   Queue *controlOut[SERVER_MAX_SHARDS]; /* joins and parts to shard i */
+   unsigned int membership[SERVER_MAX_SHARDS][SERVER_CLIENT_WORDS]; /* local slots shard i has to hear a join or part of */
+   unsigned short remote[SERVER_MAX_SHARDS][SERVER_MAX_CLIENTS]; /* remote slot to our slot, 0 = none */
+   unsigned short freeRemote[SERVER_MAX_ACTORS - SERVER_MAX_CLIENTS];
+   unsigned int numFreeRemote;
+   GameActors actors;
+   float fallingSpeed[SERVER_MAX_CLIENTS]; /* simulation state of local actors */
+   GameActors published; /* local actors as last sent to other shards */
+   GameActors history[SNAPSHOT_HISTORY]; /* actors at the end of each tick */
+   SnapshotCache cache;
+   SnapshotCandidate candidates[SERVER_MAX_ACTORS];
+   SpatialGrid grid;
+   Client clients[SERVER_MAX_ACTORS]; /* slot table, local clients indexed by peer->incomingPeerID */
+   ClientView views[SERVER_MAX_CLIENTS];
+   unsigned int active[SERVER_MAX_ACTORS]; /* dense list of used slots */
+   unsigned int numActive;
+   unsigned int tick; /* starts from 1, 0 is no tick */
+   long tickInterval; /* in nanoseconds */
+   unsigned int peerBandwidth; /* snapshot bytes per second per peer */
+   long simTime; /* nanoseconds not simulated yet */
+   enet_uint32 tickTime; /* enet_time_get() at start of the tick */
+   int epoll, timer, wake; /* worker event loop */
+   int running;
+   Journal *journal; /* NULL unless recording */
+   Metrics metrics;
+   Metrics metricsPublished; /* copy of metrics readable from other threads */
+   pthread_mutex_t metricsLock; /* guards metricsPublished */
 } ServerData;
 
-static Client* serverNewClient(ServerData *data, Client *params)
+#define serverClientForActive(data, i) (&(data)->clients[(data)->active[i]])
+
+static int gridCoordinate(float v, float min)
+{
+   int c = (v - min) / SERVER_GRID_CELL_SIZE;
+   if (c < 0) return 0;
+   if (c >= SERVER_GRID_SIZE) return SERVER_GRID_SIZE - 1;
+   return c;
+}
+
+static int gridCellFor(const Vector3f *position)
+{
+   return gridCoordinate(position->z, world.z.min) * SERVER_GRID_SIZE + gridCoordinate(position->x, world.x.min);
+}
+
+static void gridRemove(SpatialGrid *grid, unsigned int slot)
+{
+   if (grid->cell[slot] < 0)
+      return;
+
+   if (grid->prev[slot] >= 0) grid->next[grid->prev[slot]] = grid->next[slot];
+   else grid->head[grid->cell[slot]] = grid->next[slot];
+   if (grid->next[slot] >= 0) grid->prev[grid->next[slot]] = grid->prev[slot];
+   grid->cell[slot] = -1;
+}
+
+static void gridInsert(SpatialGrid *grid, unsigned int slot, int cell)
+{
+   grid->cell[slot] = cell;
+   grid->prev[slot] = -1;
+   grid->next[slot] = grid->head[cell];
+   if (grid->head[cell] >= 0) grid->prev[grid->head[cell]] = slot;
+   grid->head[cell] = slot;
+}
+
+/* move actor to the cell of its current position */
+static void serverGridUpdate(ServerData *data, unsigned int slot)
+{
+   const int cell = gridCellFor(&data->actors.position[slot]);
+   if (data->grid.cell[slot] == cell)
+      return;
+
+   gridRemove(&data->grid, slot);
+   gridInsert(&data->grid, slot, cell);
+}
+
+static void clientResetBaseline(ClientView *view, unsigned int slot)
+{
+   unsigned int t;
+   view->acked[slot] = 0;
+   view->priority[slot] = 0.0f;
+   for (t = 0; t != SNAPSHOT_HISTORY; ++t)
+      SLOT_CLEAR(view->sent[t], slot);
+}
+
+/* forget everything clients know about the slot */
+static void serverResetBaselines(ServerData *data, unsigned int slot)
 {
+   unsigned int i;
    Client *c;
 
-   /* add to list */
-   for (c = data->clients; c && c->next; c = c->next);
-   if (c) c = c->next = malloc(sizeof(Client));
-   else c = data->clients = malloc(sizeof(Client));
+   for (i = 0; i < data->numActive; ++i) {
+      c = serverClientForActive(data, i);
+      if (!c->view) continue;
+      clientResetBaseline(c->view, slot);
+      SLOT_CLEAR(c->view->interest, slot);
+   }
+}
+
+static Client* serverNewActor(ServerData *data, Client *params, unsigned int slot)
+{
+   Client *c;
+   assert(slot < SERVER_MAX_ACTORS);
 
+   c = &data->clients[slot];
    memcpy(c, params, sizeof(Client));
+   c->slot = slot;
+   c->activeIndex = data->numActive;
+   data->active[data->numActive++] = c->slot;
+
+   data->actors.flags[c->slot] = 0;
+   data->actors.rotation[c->slot] = 0;
+   memset(&data->actors.position[c->slot], 0, sizeof(Vector3f));
+   serverGridUpdate(data, c->slot);
+
+   /* slot may have been used by someone else */
+   serverResetBaselines(data, c->slot);
    return c;
 }
 
+static Client* serverNewClient(ServerData *data, Client *params)
+{
+   assert(params->peer && params->peer->incomingPeerID < SERVER_MAX_CLIENTS);
+
+   /* enet gives us the slot */
+   params->view = &data->views[params->peer->incomingPeerID];
+   memset(params->view, 0, sizeof(ClientView));
+   data->fallingSpeed[params->peer->incomingPeerID] = 0.0f;
+   return serverNewActor(data, params, params->peer->incomingPeerID);
+}
+
+/* actor connected to another shard */
+static Client* serverNewRemote(ServerData *data, Client *params)
+{
+   if (!data->numFreeRemote)
+      return NULL;
+
+   return serverNewActor(data, params, data->freeRemote[--data->numFreeRemote]);
+}
+
 static void serverFreeClient(ServerData *data, Client *client)
 {
-   Client *c;
+   Client *last;
+   assert(data->numActive);
+
+   if (!client->peer)
+      data->freeRemote[data->numFreeRemote++] = client->slot;
 
-   /* remove from list */
-   for (c = data->clients; c != client && c->next != client; c = c->next);
-   if (c == client) data->clients = client->next;
-   else if (c) c->next = client->next;
+   /* swap last active slot in place of ours */
+   last = serverClientForActive(data, --data->numActive);
+   data->active[client->activeIndex] = last->slot;
+   last->activeIndex = client->activeIndex;
 
-   free(client);
+   gridRemove(&data->grid, client->slot);
+   serverResetBaselines(data, client->slot);
+   memset(client, 0, sizeof(Client));
 }
 
-static void initServerData(ServerData *data)
+static void initServerData(ServerData *data, unsigned int shard, unsigned int numShards)
 {
-   assert(data);
+   const char *rate, *bandwidth;
+   unsigned int i;
+   int tickRate = SERVER_DEFAULT_TICKRATE;
+   assert(data && shard < numShards && numShards <= SERVER_MAX_SHARDS);
    memset(data, 0, sizeof(ServerData));
+   memset(&data->grid, -1, sizeof(SpatialGrid));
+   data->tick = 1;
+   data->shard = shard;
+   data->numShards = numShards;
+
+   /* lowest slots are handed out first */
+   for (i = SERVER_MAX_ACTORS; i > SERVER_MAX_CLIENTS; --i)
+      data->freeRemote[data->numFreeRemote++] = i - 1;
+
+   if ((rate = getenv("SRVBIRTH_TICKRATE")) && atoi(rate) > 0)
+      tickRate = atoi(rate);
+
+   data->tickInterval = 1000000000L / tickRate;
+   if (!data->tickInterval) data->tickInterval = 1;
+
+   data->peerBandwidth = SERVER_DEFAULT_PEER_BANDWIDTH;
+   if ((bandwidth = getenv("SRVBIRTH_PEER_BANDWIDTH")) && atoi(bandwidth) > 0)
+      data->peerBandwidth = atoi(bandwidth);
+
+   data->epoll = data->timer = data->wake = -1;
+   pthread_mutex_init(&data->metricsLock, NULL);
+}
+
+static enet_uint8 serverChannelFor(enet_uint32 flag)
+{
+   return (flag & ENET_PACKET_FLAG_RELIABLE ? CHANNEL_CONTROL : CHANNEL_STATE);
 }
 
-static void serverSend(Client *client, unsigned char *pdata, size_t size, ENetPacketFlag flag)
+static void serverSend(ServerData *data, Client *client, unsigned char *pdata, size_t size, ENetPacketFlag flag)
 {
    ENetPacket *packet;
    packet = enet_packet_create(pdata, size, flag);
-   enet_peer_send(client->peer, 0, packet);
+   enet_peer_send(client->peer, serverChannelFor(flag), packet);
+   metricsPacketOut(&data->metrics, ((PacketServerGeneric*)pdata)->id, size);
 }
 
 static int initEnet(const char *host_ip, const int host_port, ServerData *data)
 {
    ENetAddress address;
+   int reuse = 1;
    assert(data);
 
-   if (enet_initialize() != 0) {
-      fprintf (stderr, "An error occurred while initializing ENet.\n");
-      return RETURN_FAIL;
-   }
-
    address.host = ENET_HOST_ANY;
    address.port = host_port;
 
    if (host_ip)
       enet_address_set_host(&address, host_ip);
 
-   data->server = enet_host_create(&address,
-         32    /* max clients */,
-         2     /* max channels */,
+   /* created unbound, every shard binds the same port
+    * and the kernel spreads peers across them by address */
+   data->server = enet_host_create(NULL,
+         SERVER_MAX_CLIENTS /* max clients */,
+         CHANNEL_COUNT /* max channels */,
          0     /* download bandwidth */,
          0     /* upload bandwidth */);
 
    if (!data->server) {
-      fprintf (stderr,
-            "An error occurred while trying to create an ENet server host.\n");
+      LOG_E("An error occurred while trying to create an ENet server host.");
+      return RETURN_FAIL;
+   }
+
+   if (setsockopt(data->server->socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0 ||
+       enet_socket_bind(data->server->socket, &address) != 0) {
+      LOG_E("An error occurred while trying to bind shard %u to port %d.", data->shard, host_port);
+      enet_host_destroy(data->server);
+      data->server = NULL;
       return RETURN_FAIL;
    }
+   data->server->address = address;
 
    /* enable compression */
    data->server->checksum = enet_crc32;
@@ -103,20 +468,204 @@ static int initEnet(const char *host_ip, const int host_port, ServerData *data)
 static int deinitEnet(ServerData *data)
 {
    assert(data);
-   enet_host_destroy(data->server);
+   if (data->server) enet_host_destroy(data->server);
+   data->server = NULL;
    return RETURN_OK;
 }
 
-static void sendFullState(ServerData *data, Client *target, Client *client)
+/* queue state to every shard that knows the actor,
+ * RETURN_FAIL if some queue was full and it has to go again */
+static int serverPublish(ServerData *data, const ShardState *state)
+{
+   unsigned int i;
+   int ret = RETURN_OK;
+
+   for (i = 0; i != data->numShards; ++i) {
+      /* join is still pending and carries the state */
+      if (!data->outbox[i] || SLOT_IS_SET(data->membership[i], state->slot)) continue;
+      if (queuePush(data->outbox[i], state) != RETURN_OK) {
+         data->metrics.shardDeferred++;
+         ret = RETURN_FAIL;
+      }
+   }
+   return ret;
+}
+
+/* join or part of the slot goes to every other shard with the next tick */
+static void serverMembershipChanged(ServerData *data, unsigned int slot)
+{
+   unsigned int i;
+   for (i = 0; i != data->numShards; ++i)
+      if (data->controlOut[i]) SLOT_SET(data->membership[i], slot);
+}
+
+static void shardMessageForActor(ServerData *data, Client *client, ShardMessageType type, ShardMessage *message)
+{
+   const unsigned int s = client->slot;
+   memset(message, 0, sizeof(ShardMessage));
+   message->type = type;
+   message->slot = s;
+   message->clientId = client->clientId;
+   message->flags = data->actors.flags[s];
+   message->rotation = data->actors.rotation[s];
+   memcpy(&message->position, &data->actors.position[s], sizeof(Vector3f));
+   if (type == SHARD_JOIN) strncpy(message->host, client->host, sizeof(message->host));
+}
+
+/* a join or part is never dropped, the slot stays pending
+ * until the control queue has room for it */
+static void serverPublishMembership(ServerData *data, unsigned int shard)
+{
+   unsigned int w, bits, s;
+   ShardMessage message;
+
+   for (w = 0; w != SERVER_CLIENT_WORDS; ++w) {
+      for (bits = data->membership[shard][w]; bits; bits &= bits - 1) {
+         s = w * 32 + __builtin_ctz(bits);
+
+         /* the slot may have been taken again since, the join of
+          * the new actor replaces the old one on the other side */
+         if (data->clients[s].peer) {
+            shardMessageForActor(data, &data->clients[s], SHARD_JOIN, &message);
+         } else {
+            memset(&message, 0, sizeof(ShardMessage));
+            message.type = SHARD_PART;
+            message.slot = s;
+         }
+
+         if (queuePush(data->controlOut[shard], &message) != RETURN_OK) {
+            data->metrics.shardDeferred++;
+            return;
+         }
+         SLOT_CLEAR(data->membership[shard], s);
+      }
+   }
+}
+
+/* relay joins, parts and local actors that changed since the last tick */
+static void serverPublishStates(ServerData *data)
+{
+   unsigned int i, n, s;
+   Client *c;
+   ShardState state;
+   GameActors *a = &data->actors, *p = &data->published;
+
+   if (data->numShards < 2)
+      return;
+
+   for (i = 0; i != data->numShards; ++i)
+      if (data->controlOut[i]) serverPublishMembership(data, i);
+
+   /* start elsewhere each tick, a full queue doesn't starve the same actors */
+   for (n = 0; n < data->numActive; ++n) {
+      c = serverClientForActive(data, (n + data->tick) % data->numActive);
+      if (!c->peer) continue;
+
+      s = c->slot;
+      if (a->flags[s] == p->flags[s] && a->rotation[s] == p->rotation[s] &&
+          !memcmp(&a->position[s], &p->position[s], sizeof(Vector3f)))
+         continue;
+
+      state.flags = a->flags[s];
+      state.rotation = a->rotation[s];
+      state.slot = s;
+      state.clientId = c->clientId;
+      memcpy(&state.position, &a->position[s], sizeof(Vector3f));
+
+      /* stays changed for a retry on the next tick */
+      if (serverPublish(data, &state) != RETURN_OK)
+         continue;
+
+      p->flags[s] = a->flags[s];
+      p->rotation[s] = a->rotation[s];
+      memcpy(&p->position[s], &a->position[s], sizeof(Vector3f));
+   }
+}
+
+/* send everything that entered and left the client's view in one packet */
+static void sendRoster(ServerData *data, Client *client)
+{
+   unsigned int i;
+   ClientView *view = client->view;
+   unsigned char pdata[sizeof(PacketServerRoster) + SERVER_ROSTER_SIZE * sizeof(unsigned int)];
+   PacketServerRoster *roster = (PacketServerRoster*)pdata;
+   unsigned int *ids = (unsigned int*)(pdata + sizeof(PacketServerRoster));
+
+   if (!view->numEnter && !view->numLeave)
+      return;
+
+   memset(roster, 0, sizeof(PacketServerRoster));
+   roster->id = PACKET_ID_ROSTER;
+   roster->enter = htons(view->numEnter);
+   roster->leave = htons(view->numLeave);
+   for (i = 0; i != view->numEnter; ++i)
+      ids[i] = htonl(view->roster[i]);
+   for (i = 0; i != view->numLeave; ++i)
+      ids[view->numEnter + i] = htonl(view->roster[SERVER_ROSTER_SIZE - 1 - i]);
+
+   serverSend(data, client, pdata, sizeof(PacketServerRoster) + (view->numEnter + view->numLeave) * sizeof(unsigned int), ENET_PACKET_FLAG_RELIABLE);
+   view->numEnter = view->numLeave = 0;
+}
+
+static void sendEnter(ServerData *data, Client *client, Client *target)
+{
+   ClientView *view = client->view;
+   if (view->numEnter + view->numLeave == SERVER_ROSTER_SIZE)
+      sendRoster(data, client);
+   view->roster[view->numEnter++] = target->clientId;
+
+   /* full state goes out with the next snapshot */
+   SLOT_SET(view->interest, target->slot);
+   clientResetBaseline(view, target->slot);
+}
+
+static void sendLeave(ServerData *data, Client *client, Client *target)
+{
+   ClientView *view = client->view;
+   if (view->numEnter + view->numLeave == SERVER_ROSTER_SIZE)
+      sendRoster(data, client);
+   view->roster[SERVER_ROSTER_SIZE - 1 - view->numLeave++] = target->clientId;
+
+   SLOT_CLEAR(view->interest, target->slot);
+   clientResetBaseline(view, target->slot);
+}
+
+static float distanceSq2D(const Vector3f *a, const Vector3f *b)
+{
+   const float x = a->x - b->x, z = a->z - b->z;
+   return x * x + z * z;
+}
+
+/* subscribe client to actors that came near, unsubscribe from those that went away */
+static void updateInterest(ServerData *data, Client *client)
 {
-   PacketServerActorFullState state;
-   memset(&state, 0, sizeof(PacketActorFullState));
-   state.id = PACKET_ID_ACTOR_FULL_STATE;
-   state.clientId = htonl(target->clientId);
-   state.flags = target->actor.flags;
-   state.rotation = target->actor.rotation;
-   memcpy(&state.position, &target->actor.position, sizeof(Vector3f));
-   serverSend(client, (unsigned char*)&state, sizeof(PacketActorFullState), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+   unsigned int w, bits, slot;
+   int s, x, z, cx, cz;
+   const int r = SERVER_AOI_ENTER / SERVER_GRID_CELL_SIZE + 1;
+   const Vector3f *positions = data->actors.position;
+   const Vector3f *position = &positions[client->slot];
+
+   for (w = 0; w != SERVER_SLOT_WORDS; ++w) {
+      for (bits = client->view->interest[w]; bits; bits &= bits - 1) {
+         slot = w * 32 + __builtin_ctz(bits);
+         if (distanceSq2D(position, &positions[slot]) > SERVER_AOI_LEAVE * SERVER_AOI_LEAVE)
+            sendLeave(data, client, &data->clients[slot]);
+      }
+   }
+
+   cx = gridCoordinate(position->x, world.x.min);
+   cz = gridCoordinate(position->z, world.z.min);
+   for (z = cz - r; z <= cz + r; ++z) {
+      if (z < 0 || z >= SERVER_GRID_SIZE) continue;
+      for (x = cx - r; x <= cx + r; ++x) {
+         if (x < 0 || x >= SERVER_GRID_SIZE) continue;
+         for (s = data->grid.head[z * SERVER_GRID_SIZE + x]; s >= 0; s = data->grid.next[s]) {
+            if ((unsigned int)s == client->slot || SLOT_IS_SET(client->view->interest, s)) continue;
+            if (distanceSq2D(position, &positions[s]) <= SERVER_AOI_ENTER * SERVER_AOI_ENTER)
+               sendEnter(data, client, &data->clients[s]);
+         }
+      }
+   }
 }
 
 static void sendJoin(ServerData *data, ENetEvent *event)
@@ -128,158 +677,1227 @@ static void sendJoin(ServerData *data, ENetEvent *event)
    enet_address_get_host_ip(&event->peer->address, client.host, sizeof(client.host));
    event->peer->data = serverNewClient(data, &client);
 
-   PacketServerClientInformation info;
-   memset(&info, 0, sizeof(PacketServerClientInformation));
-   info.id = PACKET_ID_CLIENT_INFORMATION;
-   strncpy(info.host, client.host, sizeof(info.host));
-   info.clientId = htonl(client.clientId);
-   for (c = data->clients; c; c = c->next) {
-      if (c == event->peer->data) continue;
-      PacketServerClientInformation info2;
-      memset(&info2, 0, sizeof(PacketServerClientInformation));
-      info2.id = PACKET_ID_CLIENT_INFORMATION;
-      strncpy(info2.host, c->host, sizeof(info2.host));
-      info2.clientId = htonl(c->clientId);
-      serverSend(event->peer->data, (unsigned char*)&info2, sizeof(PacketServerClientInformation), ENET_PACKET_FLAG_RELIABLE);
-      sendFullState(data, c, event->peer->data);
-      serverSend(c, (unsigned char*)&info, sizeof(PacketServerClientInformation), ENET_PACKET_FLAG_RELIABLE);
-   }
-
+   /* nearby clients are introduced on the next tick */
    c = (Client*)event->peer->data;
-   printf("%s [%u] connected.\n", c->host, c->clientId);
+   LOG_I("%s [%u] connected to shard %u.", c->host, c->clientId, data->shard);
+
+   data->published.flags[c->slot] = 0;
+   data->published.rotation[c->slot] = 0;
+   memset(&data->published.position[c->slot], 0, sizeof(Vector3f));
+   serverMembershipChanged(data, c->slot);
+}
+
+/* leaves with the next roster of everyone who sees c */
+static void sendPartFor(ServerData *data, Client *c)
+{
+   unsigned int i;
+   Client *recipient;
+
+   for (i = 0; i < data->numActive; ++i) {
+      recipient = serverClientForActive(data, i);
+      if (recipient->peer && recipient != c && SLOT_IS_SET(recipient->view->interest, c->slot))
+         sendLeave(data, recipient, c);
+   }
 }
 
 static void sendPart(ServerData *data, ENetEvent *event)
 {
    Client *c;
-   PacketServerClientPart part;
 
    c = (Client*)event->peer->data;
-   memset(&part, 0, sizeof(PacketServerClientPart));
-   part.id = PACKET_ID_CLIENT_PART;
-   part.clientId = htonl(c->clientId);
-   for (c = data->clients; c; c = c->next) {
-      if (c == event->peer->data) continue;
-      serverSend(c, (unsigned char*)&part, sizeof(PacketServerClientPart), ENET_PACKET_FLAG_RELIABLE);
+   sendPartFor(data, c);
+   serverMembershipChanged(data, c->slot);
+   LOG_I("%s [%u] disconnected.", c->host, c->clientId);
+}
+
+static void shardRemoveRemote(ServerData *data, unsigned short *slot)
+{
+   Client *c = &data->clients[*slot];
+   sendPartFor(data, c);
+   serverFreeClient(data, c);
+   *slot = 0;
+}
+
+static void handleShardMessage(ServerData *data, unsigned int shard, const ShardMessage *message)
+{
+   Client client, *c;
+   unsigned short *slot = &data->remote[shard][message->slot];
+
+   switch (message->type) {
+      case SHARD_JOIN:
+         /* part of the previous actor in the slot coalesced into this */
+         if (*slot && data->clients[*slot].clientId != message->clientId)
+            shardRemoveRemote(data, slot);
+
+         if (!*slot) {
+            memset(&client, 0, sizeof(Client));
+            client.clientId = message->clientId;
+            strncpy(client.host, message->host, sizeof(client.host) - 1);
+            if (!(c = serverNewRemote(data, &client))) {
+               LOG_W("Shard %u out of remote slots, %s [%u] stays invisible.", data->shard, client.host, client.clientId);
+               break;
+            }
+            *slot = c->slot;
+         }
+         /* fall through */
+
+      case SHARD_STATE:
+         if (!*slot || data->clients[*slot].clientId != message->clientId) break;
+         data->actors.flags[*slot] = message->flags;
+         data->actors.rotation[*slot] = message->rotation;
+         memcpy(&data->actors.position[*slot], &message->position, sizeof(Vector3f));
+         serverGridUpdate(data, *slot);
+         break;
+
+      case SHARD_PART:
+         if (*slot) shardRemoveRemote(data, slot);
+         break;
    }
+}
 
-   c = (Client*)event->peer->data;
-   printf("%s [%u] disconnected.\n", c->host, c->clientId);
+static void serverReceiveShardMessage(ServerData *data, uint32_t shard, const ShardMessage *message)
+{
+   unsigned char record[sizeof(uint32_t) + sizeof(ShardMessage)];
+
+   if (data->journal) {
+      memcpy(record, &shard, sizeof(uint32_t));
+      memcpy(record + sizeof(uint32_t), message, sizeof(ShardMessage));
+      journalWrite(data->journal, JOURNAL_SHARD, 0, 0, 0, record, sizeof(record));
+   }
+   handleShardMessage(data, shard, message);
+}
+
+/* apply what other shards published since last tick,
+ * joins and parts first as the states may be of the joined */
+static void serverReceiveShards(ServerData *data)
+{
+   uint32_t i;
+   ShardState state;
+   ShardMessage message;
+
+   for (i = 0; i != data->numShards; ++i) {
+      if (!data->inbox[i]) continue;
+      while (queuePop(data->controlIn[i], &message) == RETURN_OK)
+         serverReceiveShardMessage(data, i, &message);
+
+      while (queuePop(data->inbox[i], &state) == RETURN_OK) {
+         memset(&message, 0, sizeof(ShardMessage));
+         message.type = SHARD_STATE;
+         message.flags = state.flags;
+         message.rotation = state.rotation;
+         message.slot = state.slot;
+         message.clientId = state.clientId;
+         memcpy(&message.position, &state.position, sizeof(Vector3f));
+         serverReceiveShardMessage(data, i, &message);
+      }
+   }
 }
 
-static void handleState(ServerData *data, ENetEvent *event)
+static void handleState(ENetEvent *event)
 {
-   PacketServerActorState state;
+   unsigned int i;
+   unsigned short sequence;
    PacketActorState *p = (PacketActorState*)event->packet->data;
-   Client *c, *client = (Client*)event->peer->data;
+   const ActorInput *inputs = (const ActorInput*)(event->packet->data + sizeof(PacketActorState));
+   ClientView *view = ((Client*)event->peer->data)->view;
 
-   state.id = p->id;
-   state.clientId = htonl(client->clientId);
-   state.flags = p->flags;
-   state.rotation = p->rotation;
-   for (c = data->clients; c; c = c->next) {
-      if (c == client) continue;
-      serverSend(c, (unsigned char*)&state, sizeof(PacketServerActorState), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+   if (event->packet->dataLength < sizeof(PacketActorState) ||
+       event->packet->dataLength < sizeof(PacketActorState) + p->count * sizeof(ActorInput))
+      return;
+
+   /* queue the ones we haven't seen, oldest first */
+   for (i = p->count; i > 0; --i) {
+      sequence = ntohs(inputs[i - 1].sequence);
+      if (view->hasReceived && (short)(sequence - view->lastReceived) <= 0)
+         continue;
+
+      /* simulation is way behind, forget the oldest */
+      if (view->numInputs == SERVER_INPUT_QUEUE)
+         memmove(view->inputs, view->inputs + 1, --view->numInputs * sizeof(ActorInput));
+
+      memcpy(&view->inputs[view->numInputs], &inputs[i - 1], sizeof(ActorInput));
+      view->inputs[view->numInputs++].sequence = sequence;
+      view->hasReceived = 1;
+      view->lastReceived = sequence;
    }
+}
+
+/* Start the next queued input once our steps reach the one the client
+ * started it on, so each input lasts as long as it did on the client.
+ * At most one per step, short taps are not lost. */
+static void serverNextInput(ServerData *data, Client *client)
+{
+   short ahead;
+   ClientView *view = client->view;
+   const ActorInput *input = &view->inputs[0];
+
+   if (!view->numInputs)
+      return;
+
+   ahead = input->sequence - (unsigned short)(view->sequence + 1);
+   if (view->hasInput && ahead > 0 && ahead <= SERVER_INPUT_SLACK && view->numInputs <= ACTOR_INPUT_REDUNDANCY)
+      return;
 
-   client->actor.flags = p->flags;
-   client->actor.rotation = p->rotation;
+   /* continue numbering steps from where the client started this input */
+   view->hasInput = 1;
+   view->inputSequence = input->sequence;
+   view->sequence = input->sequence - 1;
+   data->actors.flags[client->slot] = input->flags;
+   data->actors.rotation[client->slot] = input->rotation;
+   memmove(view->inputs, view->inputs + 1, --view->numInputs * sizeof(ActorInput));
 }
 
 static void handleFullState(ServerData *data, ENetEvent *event)
 {
-   PacketServerActorFullState state;
-   PacketActorFullState *p = (PacketActorFullState*)event->packet->data;
-   Client *c, *client = (Client*)event->peer->data;
+   BitStream stream;
+   PacketActorFullState p;
+   Client *client = (Client*)event->peer->data;
+
+   bitStreamInit(&stream, event->packet->data + sizeof(PacketGeneric), event->packet->dataLength - sizeof(PacketGeneric));
+   if (packetReadActorFullState(&stream, &p) != RETURN_OK)
+      return;
+
+   /* position is ours to simulate, only take the input */
+   data->actors.flags[client->slot] = p.flags;
+   data->actors.rotation[client->slot] = p.rotation;
+}
+
+static void handleSnapshotAck(ENetEvent *event)
+{
+   unsigned int i, w, bits, tick, index;
+   PacketSnapshotAck *p = (PacketSnapshotAck*)event->packet->data;
+   ClientView *view = ((Client*)event->peer->data)->view;
+
+   if (event->packet->dataLength < sizeof(PacketSnapshotAck))
+      return;
+
+   tick = ntohl(p->tick);
+   index = tick % SNAPSHOT_HISTORY;
+   if (!tick || view->sentTick[index] != tick)
+      return;
+
+   /* client now has everything we sent in that snapshot */
+   for (w = 0; w != SERVER_SLOT_WORDS; ++w) {
+      for (bits = view->sent[index][w]; bits; bits &= bits - 1) {
+         i = w * 32 + __builtin_ctz(bits);
+         if (view->acked[i] < tick)
+            view->acked[i] = tick;
+      }
+   }
+}
+
+static size_t encodeSnapshotActor(ServerData *data, Client *target, unsigned int base, unsigned char *out)
+{
+   const Vector3fQuantization *q = &world;
+   const GameActors *from;
+   const GameActors *to = &data->actors;
+   const unsigned int s = target->slot;
+   BitStream stream;
+   PacketSnapshotActor actor;
+
+   memset(&actor, 0, sizeof(PacketSnapshotActor));
+   actor.mask = SNAPSHOT_ALL;
 
-   state.id = p->id;
-   state.clientId = htonl(client->clientId);
-   state.flags = p->flags;
-   state.rotation = p->rotation;
-   memcpy(&state.position, &p->position, sizeof(Vector3f));
-   for (c = data->clients; c; c = c->next) {
-      if (c == client) continue;
-      serverSend(c, (unsigned char*)&state, sizeof(PacketServerActorFullState), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+   /* field delta against the baseline, positions compared as they go to the wire */
+   if (base) {
+      from = &data->history[base % SNAPSHOT_HISTORY];
+      actor.mask = 0;
+      if (from->flags[s] != to->flags[s])
+         actor.mask |= SNAPSHOT_FLAGS;
+      if (from->rotation[s] != to->rotation[s])
+         actor.mask |= SNAPSHOT_ROTATION;
+      if (quantize(from->position[s].x, &q->x) != quantize(to->position[s].x, &q->x))
+         actor.mask |= SNAPSHOT_POSITION_X;
+      if (quantize(from->position[s].y, &q->y) != quantize(to->position[s].y, &q->y))
+         actor.mask |= SNAPSHOT_POSITION_Y;
+      if (quantize(from->position[s].z, &q->z) != quantize(to->position[s].z, &q->z))
+         actor.mask |= SNAPSHOT_POSITION_Z;
    }
 
-   client->actor.flags = p->flags;
-   client->actor.rotation = p->rotation;
-   memcpy(&client->actor.position, &p->position, sizeof(Vector3f));
+   /* nothing changed */
+   if (!actor.mask)
+      return 0;
+
+   actor.clientId = target->clientId;
+   actor.base = (base ? data->tick - base : 0);
+   actor.flags = to->flags[s];
+   actor.rotation = to->rotation[s];
+   memcpy(&actor.position, &to->position[s], sizeof(Vector3f));
+
+   bitStreamInit(&stream, out, PACKET_SNAPSHOT_ACTOR_SIZE);
+   packetWriteSnapshotActor(&stream, &actor);
+   return bitStreamBytes(&stream);
 }
 
-static int manageEnet(ServerData *data)
+/* Write snapshot entry of target against base to out.
+ * Each (target, base) pair is encoded only once per tick,
+ * other clients on the same baseline get a copy. */
+static size_t writeSnapshotActor(ServerData *data, Client *target, unsigned int base, unsigned char *out)
+{
+   unsigned int i;
+   size_t size;
+   SnapshotCache *cache = &data->cache;
+   const unsigned int s = target->slot;
+
+   for (i = 0; i != cache->count[s]; ++i) {
+      if (cache->base[s][i] != base) continue;
+      memcpy(out, cache->data + cache->offset[s][i], cache->size[s][i]);
+      return cache->size[s][i];
+   }
+
+   /* too many baselines in flight, don't cache */
+   if (cache->count[s] == SNAPSHOT_CACHE_SIZE)
+      return encodeSnapshotActor(data, target, base, out);
+
+   i = cache->count[s]++;
+   size = encodeSnapshotActor(data, target, base, cache->data + cache->used);
+   cache->base[s][i] = base;
+   cache->offset[s][i] = cache->used;
+   cache->size[s][i] = size;
+   cache->used += size;
+   memcpy(out, cache->data + cache->offset[s][i], size);
+   return size;
+}
+
+static int compareCandidates(const void *a, const void *b)
+{
+   const float pa = ((const SnapshotCandidate*)a)->priority;
+   const float pb = ((const SnapshotCandidate*)b)->priority;
+   return (pa < pb) - (pa > pb);
+}
+
+/* snapshot bytes the peer gets this tick, backs off with enet's throttle */
+static size_t serverSnapshotBudget(ServerData *data, Client *client)
+{
+   unsigned long budget = (unsigned long long)data->peerBandwidth * data->tickInterval / 1000000000L;
+   const ENetPeer *peer = client->peer;
+
+   /* client asked for less */
+   if (peer->incomingBandwidth && peer->incomingBandwidth < data->peerBandwidth)
+      budget = (unsigned long long)peer->incomingBandwidth * data->tickInterval / 1000000000L;
+
+   budget = budget * peer->packetThrottle / ENET_PEER_PACKET_THROTTLE_SCALE;
+   return (budget < SERVER_MIN_BUDGET ? SERVER_MIN_BUDGET : budget);
+}
+
+/* Grow priority of every subscribed actor, nearby and unknown ones faster.
+ * Returns amount of candidates written, highest priority first. */
+static unsigned int serverPrioritize(ServerData *data, Client *client)
+{
+   unsigned int w, bits, s, count = 0;
+   float dx, dz, near;
+   ClientView *view = client->view;
+   const Vector3f *own = &data->actors.position[client->slot];
+   SnapshotCandidate *candidates = data->candidates;
+
+   for (w = 0; w != SERVER_SLOT_WORDS; ++w) {
+      for (bits = view->interest[w]; bits; bits &= bits - 1) {
+         s = w * 32 + __builtin_ctz(bits);
+         dx = data->actors.position[s].x - own->x;
+         dz = data->actors.position[s].z - own->z;
+         near = 1.0f - sqrtf(dx * dx + dz * dz) / SERVER_AOI_LEAVE;
+         if (near < 0.0f) near = 0.0f;
+
+         view->priority[s] += SERVER_PRIORITY_BASE + SERVER_PRIORITY_NEAR * near;
+         if (!view->acked[s]) view->priority[s] += SERVER_PRIORITY_NEW;
+
+         candidates[count].priority = view->priority[s];
+         candidates[count].slot = s;
+         count++;
+      }
+   }
+
+   qsort(candidates, count, sizeof(SnapshotCandidate), compareCandidates);
+   return count;
+}
+
+static void sendSnapshot(ServerData *data, Client *client)
+{
+   unsigned int i, count, base;
+   const unsigned int index = data->tick % SNAPSHOT_HISTORY;
+   size_t size, entry, budget;
+   Client *c;
+   ClientView *view = client->view;
+   ENetPacket *packet;
+   PacketServerSnapshot *snapshot;
+
+   view->sentTick[index] = data->tick;
+   memset(view->sent[index], 0, sizeof(view->sent[index]));
+
+   if (!(count = serverPrioritize(data, client)))
+      return;
+
+   /* gather straight into the packet, shrink afterwards */
+   if (!(packet = enet_packet_create(NULL, sizeof(PacketServerSnapshot) +
+               (count < 255 ? count : 255) * PACKET_SNAPSHOT_ACTOR_SIZE,
+               ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT)))
+      return;
+
+   snapshot = (PacketServerSnapshot*)packet->data;
+   memset(snapshot, 0, sizeof(PacketServerSnapshot));
+   snapshot->id = PACKET_ID_SNAPSHOT;
+   snapshot->tick = htonl(data->tick);
+   snapshot->time = htonl(data->tickTime);
+   size = sizeof(PacketServerSnapshot);
+   budget = size + serverSnapshotBudget(data, client);
+
+   /* what doesn't fit keeps its priority and goes out on a later tick */
+   for (i = 0; i != count && snapshot->count < 255 && size < budget; ++i) {
+      c = &data->clients[data->candidates[i].slot];
+
+      /* baseline fell out of history */
+      base = view->acked[c->slot];
+      if (base && data->tick - base >= SNAPSHOT_HISTORY)
+         base = 0;
+
+      /* client is up to date */
+      if (!(entry = writeSnapshotActor(data, c, base, packet->data + size))) {
+         view->priority[c->slot] = 0.0f;
+         continue;
+      }
+
+      if (size + entry > budget && snapshot->count) {
+         data->metrics.deferredEntries++;
+         continue;
+      }
+
+      size += entry;
+      snapshot->count++;
+      view->priority[c->slot] = 0.0f;
+      SLOT_SET(view->sent[index], c->slot);
+   }
+
+   if (!snapshot->count) {
+      enet_packet_destroy(packet);
+      return;
+   }
+
+   enet_packet_resize(packet, size);
+   enet_peer_send(client->peer, CHANNEL_STATE, packet);
+   metricsPacketOut(&data->metrics, PACKET_ID_SNAPSHOT, size);
+}
+
+/* move local actors by their last input, in fixed steps */
+static void serverSimulate(ServerData *data)
+{
+   unsigned int i, s;
+   const long step = 1000000000L / SIM_TICKRATE;
+   SimState state;
+   Client *c;
+
+   for (data->simTime += data->tickInterval; data->simTime >= step; data->simTime -= step) {
+      for (i = 0; i < data->numActive; ++i) {
+         c = serverClientForActive(data, i);
+         if (!c->peer) continue;
+
+         serverNextInput(data, c);
+         s = c->slot;
+         memcpy(&state.position, &data->actors.position[s], sizeof(Vector3f));
+         state.fallingSpeed = data->fallingSpeed[s];
+         simStep(&state, data->actors.flags[s], simRotation(data->actors.rotation[s]));
+         memcpy(&data->actors.position[s], &state.position, sizeof(Vector3f));
+         data->fallingSpeed[s] = state.fallingSpeed;
+         c->view->sequence++;
+      }
+   }
+
+   for (i = 0; i < data->numActive; ++i) {
+      c = serverClientForActive(data, i);
+      if (c->peer) serverGridUpdate(data, c->slot);
+   }
+}
+
+/* tell client where the server has it, so it can replay its inputs from there */
+static void sendCorrection(ServerData *data, Client *client)
+{
+   BitStream stream;
+   PacketServerActorCorrection correction;
+   unsigned char pdata[sizeof(PacketServerGeneric) + PACKET_ACTOR_CORRECTION_SIZE];
+   const unsigned int s = client->slot;
+
+   memset(&correction, 0, sizeof(PacketServerActorCorrection));
+   correction.sequence = client->view->sequence;
+   correction.flags = data->actors.flags[s];
+   correction.rotation = data->actors.rotation[s];
+   memcpy(&correction.position, &data->actors.position[s], sizeof(Vector3f));
+   correction.fallingSpeed = data->fallingSpeed[s];
+
+   memset(pdata, 0, sizeof(PacketServerGeneric));
+   ((PacketServerGeneric*)pdata)->id = PACKET_ID_ACTOR_CORRECTION;
+   ((PacketServerGeneric*)pdata)->clientId = htonl(client->clientId);
+   bitStreamInit(&stream, pdata + sizeof(PacketServerGeneric), PACKET_ACTOR_CORRECTION_SIZE);
+   packetWriteActorCorrection(&stream, &correction);
+   serverSend(data, client, pdata, sizeof(PacketServerGeneric) + bitStreamBytes(&stream), 0);
+}
+
+static void serverTick(ServerData *data)
+{
+   unsigned int i;
+   Client *c;
+
+   data->tickTime = enet_time_get();
+   serverReceiveShards(data);
+
+   /* replay runs the tick when it gets here */
+   if (data->journal)
+      journalWrite(data->journal, JOURNAL_TICK, 0, 0, 0, NULL, 0);
+
+   serverSimulate(data);
+   serverPublishStates(data);
+
+   /* this tick becomes a baseline */
+   memcpy(&data->history[data->tick % SNAPSHOT_HISTORY], &data->actors, sizeof(GameActors));
+   memset(data->cache.count, 0, sizeof(data->cache.count));
+   data->cache.used = 0;
+
+   for (i = 0; i < data->numActive; ++i) {
+      c = serverClientForActive(data, i);
+      if (c->peer) updateInterest(data, c);
+   }
+
+   for (i = 0; i < data->numActive; ++i) {
+      c = serverClientForActive(data, i);
+      if (!c->peer) continue;
+      sendRoster(data, c);
+      sendSnapshot(data, c);
+
+      /* spread over ticks */
+      if (c->view->hasInput && !((data->tick + c->slot) % SERVER_CORRECTION_INTERVAL))
+         sendCorrection(data, c);
+   }
+
+   data->tick++;
+}
+
+static void serverJournalEvent(ServerData *data, const ENetEvent *event)
+{
+   const ENetPeer *peer = event->peer;
+
+   switch (event->type) {
+      case ENET_EVENT_TYPE_CONNECT:
+         journalWrite(data->journal, JOURNAL_CONNECT, peer->incomingPeerID, peer->connectID, 0,
+               &peer->address, sizeof(ENetAddress));
+         break;
+      case ENET_EVENT_TYPE_RECEIVE:
+         journalWrite(data->journal, JOURNAL_RECEIVE, peer->incomingPeerID, peer->connectID, event->channelID,
+               event->packet->data, event->packet->dataLength);
+         break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+         journalWrite(data->journal, JOURNAL_DISCONNECT, peer->incomingPeerID, peer->connectID, 0, NULL, 0);
+         break;
+      default:
+         break;
+   }
+}
+
+/* everything peers do goes through here, live or replayed */
+static void serverHandleEvent(ServerData *data, ENetEvent *event)
 {
-   ENetEvent event;
    PacketGeneric *packet;
-   Client *client;
-   assert(data);
+   unsigned long start;
+
+   if (data->journal)
+      serverJournalEvent(data, event);
+
+   switch (event->type) {
+      case ENET_EVENT_TYPE_CONNECT:
+         LOG_D("A new client connected from %x:%u.",
+               event->peer->address.host,
+               event->peer->address.port);
+
+         /* broadcast join message to others */
+         start = metricsNow();
+         sendJoin(data, event);
+         histogramAdd(&data->metrics.join, metricsNow() - start);
+         break;
 
-   /* Wait up to 1000 milliseconds for an event. */
-   while (enet_host_service(data->server, &event, 1000) > 0) {
-      switch (event.type) {
-         case ENET_EVENT_TYPE_CONNECT:
-            printf("A new client connected from %x:%u.\n",
-                  event.peer->address.host,
-                  event.peer->address.port);
-
-            /* broadcast join message to others */
-            sendJoin(data, &event);
-            client = (Client*)event.peer->data;
+      case ENET_EVENT_TYPE_RECEIVE:
+         metricsPacketIn(&data->metrics, event->packet->data, event->packet->dataLength);
+
+         /* discard bad packets */
+         if (event->packet->dataLength < sizeof(PacketGeneric)) {
+            enet_packet_destroy(event->packet);
             break;
+         }
+
+         LOG_D("A packet of length %zu was received on channel %u.",
+               event->packet->dataLength,
+               event->channelID);
 
-         case ENET_EVENT_TYPE_RECEIVE:
-            /* discard bad packets */
-            if (event.packet->dataLength < sizeof(PacketGeneric))
+         /* handle packet */
+         packet = (PacketGeneric*)event->packet->data;
+         start = metricsNowNsec();
+         switch (packet->id) {
+            case PACKET_ID_ACTOR_STATE:
+               handleState(event);
+               break;
+            case PACKET_ID_ACTOR_FULL_STATE:
+               handleFullState(data, event);
+               break;
+            case PACKET_ID_SNAPSHOT_ACK:
+               handleSnapshotAck(event);
                break;
+         }
 
-            printf("A packet of length %u was received on channel %u.\n",
-                  event.packet->dataLength,
-                  event.channelID);
-
-            /* handle packet */
-            client = (Client*)event.peer->data;
-            packet = (PacketGeneric*)event.packet->data;
-            switch (packet->id) {
-               case PACKET_ID_ACTOR_STATE:
-                  handleState(data, &event);
-                  break;
-               case PACKET_ID_ACTOR_FULL_STATE:
-                  handleFullState(data, &event);
-                  break;
-            }
+         if (packet->id < PACKET_ID_LAST)
+            histogramAdd(&data->metrics.handler[packet->id], metricsNowNsec() - start);
 
-            /* Clean up the packet now that we're done using it. */
-            enet_packet_destroy(event.packet);
-            break;
+         /* Clean up the packet now that we're done using it. */
+         enet_packet_destroy(event->packet);
+         break;
+
+      case ENET_EVENT_TYPE_DISCONNECT:
+         /* broadcast part message to others */
+         sendPart(data, event);
+
+         /* Reset the peer's client information. */
+         serverFreeClient(data, event->peer->data);
+         event->peer->data = NULL;
+         break;
+
+      default:
+         break;
+   }
+}
+
+/* handle everything enet has for us without blocking */
+static int serviceEnet(ServerData *data)
+{
+   ENetEvent event;
+   assert(data);
+
+   while (enet_host_service(data->server, &event, 0) > 0)
+      serverHandleEvent(data, &event);
+
+   return RETURN_OK;
+}
+
+static int initEventLoop(ServerData *data)
+{
+   struct epoll_event ev;
+   struct itimerspec tick;
+   assert(data);
+
+   if ((data->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+       (data->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+       (data->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      LOG_E("An error occurred while creating the event loop for shard %u.", data->shard);
+      return RETURN_FAIL;
+   }
+
+   memset(&tick, 0, sizeof(tick));
+   tick.it_interval.tv_sec = data->tickInterval / 1000000000L;
+   tick.it_interval.tv_nsec = data->tickInterval % 1000000000L;
+   tick.it_value = tick.it_interval;
+   if (timerfd_settime(data->timer, 0, &tick, NULL) != 0)
+      return RETURN_FAIL;
+
+   /* fd is the event data, we only have three */
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = data->server->socket;
+   if (epoll_ctl(data->epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0) return RETURN_FAIL;
+   ev.data.fd = data->timer;
+   if (epoll_ctl(data->epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0) return RETURN_FAIL;
+   ev.data.fd = data->wake;
+   if (epoll_ctl(data->epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0) return RETURN_FAIL;
+
+   data->running = 1;
+   return RETURN_OK;
+}
+
+static void deinitEventLoop(ServerData *data)
+{
+   assert(data);
+   if (data->epoll >= 0) close(data->epoll);
+   if (data->timer >= 0) close(data->timer);
+   if (data->wake >= 0) close(data->wake);
+   data->epoll = data->timer = data->wake = -1;
+}
+
+/* make metrics visible to the stats reporter */
+static void serverPublishMetrics(ServerData *data)
+{
+   unsigned int i;
+   Client *c;
+   PeerMetrics *peer;
+
+   data->metrics.numPeers = 0;
+   for (i = 0; i < data->numActive && data->metrics.numPeers < METRICS_MAX_PEERS; ++i) {
+      c = serverClientForActive(data, i);
+      if (!c->peer) continue;
+      peer = &data->metrics.peers[data->metrics.numPeers++];
+      peer->clientId = c->clientId;
+      peer->shard = data->shard;
+      peer->roundTripTime = c->peer->roundTripTime;
+      peer->roundTripTimeVariance = c->peer->roundTripTimeVariance;
+      peer->packetLoss = c->peer->packetLoss;
+   }
+
+   pthread_mutex_lock(&data->metricsLock);
+   memcpy(&data->metricsPublished, &data->metrics, sizeof(Metrics));
+   pthread_mutex_unlock(&data->metricsLock);
+}
+
+/* ask worker to stop, safe from any thread */
+static void serverStop(ServerData *data)
+{
+   const uint64_t one = 1;
+   if (data->wake >= 0 && write(data->wake, &one, sizeof(one)) != sizeof(one))
+      LOG_E("Failed to wake shard %u.", data->shard);
+}
+
+static int manageEnet(ServerData *data)
+{
+   struct epoll_event events[3];
+   uint64_t expirations;
+   unsigned long start;
+   int i, count;
+   assert(data);
+
+   if ((count = epoll_wait(data->epoll, events, 3, -1)) < 0)
+      return RETURN_FAIL;
+
+   for (i = 0; i < count; ++i) {
+      if (events[i].data.fd == data->wake) {
+         data->running = 0;
+      } else if (events[i].data.fd == data->timer) {
+         /* more than one expiration means we fell behind, skip those ticks */
+         if (read(data->timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+            continue;
 
-         case ENET_EVENT_TYPE_DISCONNECT:
-            /* broadcast part message to others */
-            sendPart(data, &event);
+         /* enet handles timeouts and resends while servicing */
+         serviceEnet(data);
+         start = metricsNow();
+         serverTick(data);
 
-            /* Reset the peer's client information. */
-            serverFreeClient(data, event.peer->data);
-            event.peer->data = NULL;
+         /* snapshots leave at the tick boundary */
+         enet_host_flush(data->server);
+         histogramAdd(&data->metrics.tick, metricsNow() - start);
+         data->metrics.ticks++;
+         data->metrics.skippedTicks += expirations - 1;
+
+         /* about once a second */
+         if (!(data->tick % (1000000000L / data->tickInterval)))
+            serverPublishMetrics(data);
+      } else {
+         /* replies go out right away */
+         serviceEnet(data);
       }
    }
 
-   /* send all response packets */
-   enet_host_flush(data->server);
    return RETURN_OK;
 }
 
+typedef struct ServerStats {
+   int socket; /* unix stream socket, report is written to each connection */
+   int timer;  /* periodic dump */
+   char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+   const char *file;
+   unsigned long started;
+} ServerStats;
+
+static int initStats(ServerStats *stats)
+{
+   struct sockaddr_un address;
+   struct itimerspec dump;
+   const char *path, *interval;
+   int seconds = SERVER_DEFAULT_STATS_INTERVAL;
+   assert(stats);
+
+   memset(stats, 0, sizeof(ServerStats));
+   stats->socket = stats->timer = -1;
+   stats->started = metricsNow();
+
+   if (!(path = getenv("SRVBIRTH_STATS_SOCKET")))
+      path = SERVER_DEFAULT_STATS_SOCKET;
+   if (!(stats->file = getenv("SRVBIRTH_STATS_FILE")))
+      stats->file = SERVER_DEFAULT_STATS_FILE;
+   if ((interval = getenv("SRVBIRTH_STATS_INTERVAL")))
+      seconds = atoi(interval);
+
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+   strncpy(stats->path, address.sun_path, sizeof(stats->path) - 1);
+
+   /* stale socket from previous run */
+   unlink(stats->path);
+   if ((stats->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+       bind(stats->socket, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+       listen(stats->socket, 8) != 0) {
+      LOG_E("Failed to open stats socket %s.", stats->path);
+      return RETURN_FAIL;
+   }
+
+   if (seconds <= 0)
+      return RETURN_OK;
+
+   if ((stats->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+      return RETURN_FAIL;
+
+   memset(&dump, 0, sizeof(dump));
+   dump.it_interval.tv_sec = seconds;
+   dump.it_value = dump.it_interval;
+   return (timerfd_settime(stats->timer, 0, &dump, NULL) == 0 ? RETURN_OK : RETURN_FAIL);
+}
+
+static void deinitStats(ServerStats *stats)
+{
+   assert(stats);
+   if (stats->socket >= 0) {
+      close(stats->socket);
+      unlink(stats->path);
+   }
+   if (stats->timer >= 0) close(stats->timer);
+   stats->socket = stats->timer = -1;
+}
+
+/* sum of what the shards last published */
+static void serverReport(ServerStats *stats, ServerData **shards, unsigned int numShards, FILE *out)
+{
+   unsigned int i;
+   Metrics *total;
+
+   if (!(total = calloc(1, sizeof(Metrics))))
+      return;
+
+   for (i = 0; i != numShards; ++i) {
+      pthread_mutex_lock(&shards[i]->metricsLock);
+      metricsMerge(total, &shards[i]->metricsPublished);
+      pthread_mutex_unlock(&shards[i]->metricsLock);
+   }
+
+   metricsWrite(total, (metricsNow() - stats->started) / 1000000, out);
+   free(total);
+}
+
+static void serverServeStats(ServerStats *stats, ServerData **shards, unsigned int numShards)
+{
+   int fd;
+   FILE *out;
+
+   if ((fd = accept4(stats->socket, NULL, NULL, SOCK_CLOEXEC)) < 0)
+      return;
+
+   if (!(out = fdopen(fd, "w"))) {
+      close(fd);
+      return;
+   }
+
+   serverReport(stats, shards, numShards, out);
+   fclose(out);
+}
+
+/* replace the dump file atomically, readers never see a partial report */
+static void serverDumpStats(ServerStats *stats, ServerData **shards, unsigned int numShards)
+{
+   uint64_t expirations;
+   char tmp[256];
+   FILE *out;
+
+   if (read(stats->timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+      return;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", stats->file);
+   if (!(out = fopen(tmp, "w"))) {
+      LOG_W("Failed to write stats to %s.", tmp);
+      return;
+   }
+
+   serverReport(stats, shards, numShards, out);
+   fclose(out);
+   if (rename(tmp, stats->file) != 0)
+      LOG_W("Failed to write stats to %s.", stats->file);
+}
+
+static void* serverWorker(void *arg)
+{
+   unsigned int i;
+   ServerData *data = (ServerData*)arg;
+
+   while (data->running) {
+      if (manageEnet(data) != RETURN_OK && errno != EINTR)
+         break;
+   }
+
+   /* let our peers know right away instead of timing out */
+   for (i = 0; i < data->numActive; ++i) {
+      if (serverClientForActive(data, i)->peer)
+         enet_peer_disconnect_now(serverClientForActive(data, i)->peer, 0);
+   }
+
+   return NULL;
+}
+
+/* record what the shard receives, SRVBIRTH_JOURNAL is the path prefix */
+static int serverOpenJournal(ServerData *data)
+{
+   char path[4096];
+   const char *prefix;
+   JournalHeader header;
+
+   if (!(prefix = getenv("SRVBIRTH_JOURNAL")) || !*prefix)
+      return RETURN_OK;
+
+   memset(&header, 0, sizeof(JournalHeader));
+   header.shard = data->shard;
+   header.numShards = data->numShards;
+   header.tickInterval = data->tickInterval;
+   snprintf(path, sizeof(path), "%s.%u", prefix, data->shard);
+   if (!(data->journal = journalNew(path, &header))) {
+      LOG_E("Could not open journal %s.", path);
+      return RETURN_FAIL;
+   }
+
+   LOG_I("Shard %u records to %s.", data->shard, path);
+   return RETURN_OK;
+}
+
+/* pretend peer completed the handshake, enet_peer_send needs the channels */
+static int replayPeerOpen(ENetPeer *peer)
+{
+   ENetChannel *channel;
+
+   if (!(peer->channels = enet_malloc(CHANNEL_COUNT * sizeof(ENetChannel))))
+      return RETURN_FAIL;
+
+   peer->channelCount = CHANNEL_COUNT;
+   for (channel = peer->channels; channel != &peer->channels[CHANNEL_COUNT]; ++channel) {
+      memset(channel, 0, sizeof(ENetChannel));
+      enet_list_clear(&channel->incomingReliableCommands);
+      enet_list_clear(&channel->incomingUnreliableCommands);
+   }
+
+   peer->state = ENET_PEER_STATE_CONNECTED;
+   return RETURN_OK;
+}
+
+/* drop what the tick queued, replayed peers have nobody listening */
+static void replayDrain(ServerData *data)
+{
+   size_t i;
+   ENetPeer *peer;
+
+   for (i = 0; i != data->server->peerCount; ++i) {
+      peer = &data->server->peers[i];
+      if (peer->state != ENET_PEER_STATE_CONNECTED) continue;
+      enet_peer_reset_queues(peer);
+      replayPeerOpen(peer);
+   }
+}
+
+static void replayWait(unsigned long started, uint64_t time)
+{
+   struct timespec ts;
+   const unsigned long now = metricsNow() - started;
+
+   if (time <= now)
+      return;
+
+   ts.tv_sec = (time - now) / 1000000;
+   ts.tv_nsec = (time - now) % 1000000 * 1000;
+   nanosleep(&ts, NULL);
+}
+
+/* Feed a journal back through the same handlers and ticks as live
+ * traffic, as fast as possible or at the recorded pace.
+ * Peers live on an unbound host and nothing reaches the wire. */
+static int serverReplay(const char *path, int realtime)
+{
+   uint32_t shard;
+   unsigned long started, start, records = 0;
+   int ret = RETURN_FAIL;
+   ENetEvent event;
+   ENetPeer *peer;
+   ShardMessage message;
+   JournalReader *reader;
+   const JournalRecord *record;
+   const unsigned char *payload;
+   ServerData *data = NULL;
+
+   if (!(reader = journalOpen(path))) {
+      LOG_E("Could not open journal %s.", path);
+      return RETURN_FAIL;
+   }
+
+   if (!(data = malloc(sizeof(ServerData))))
+      goto out;
+
+   /* alone, nobody to publish to */
+   initServerData(data, 0, 1);
+   data->tickInterval = reader->header.tickInterval;
+   if (!(data->server = enet_host_create(NULL, SERVER_MAX_CLIENTS, CHANNEL_COUNT, 0, 0))) {
+      LOG_E("An error occurred while trying to create an ENet server host.");
+      goto out;
+   }
+
+   started = metricsNow();
+   while (journalNext(reader, &record, &payload) == RETURN_OK) {
+      if (realtime) replayWait(started, record->time);
+      records++;
+
+      memset(&event, 0, sizeof(ENetEvent));
+      peer = event.peer = (record->peer < data->server->peerCount ? &data->server->peers[record->peer] : NULL);
+
+      switch (record->type) {
+         case JOURNAL_CONNECT:
+            if (!peer || peer->state == ENET_PEER_STATE_CONNECTED || record->size != sizeof(ENetAddress))
+               break;
+            memcpy(&peer->address, payload, sizeof(ENetAddress));
+            peer->connectID = record->connectID;
+            if (replayPeerOpen(peer) != RETURN_OK)
+               goto out;
+            event.type = ENET_EVENT_TYPE_CONNECT;
+            serverHandleEvent(data, &event);
+            break;
+
+         case JOURNAL_RECEIVE:
+            if (!peer || peer->state != ENET_PEER_STATE_CONNECTED)
+               break;
+            if (!(event.packet = enet_packet_create(payload, record->size, 0)))
+               goto out;
+            event.type = ENET_EVENT_TYPE_RECEIVE;
+            event.channelID = record->channel;
+            serverHandleEvent(data, &event);
+            break;
+
+         case JOURNAL_DISCONNECT:
+            if (!peer || peer->state != ENET_PEER_STATE_CONNECTED)
+               break;
+            event.type = ENET_EVENT_TYPE_DISCONNECT;
+            serverHandleEvent(data, &event);
+            enet_peer_reset(peer);
+            break;
+
+         case JOURNAL_SHARD:
+            if (record->size != sizeof(uint32_t) + sizeof(ShardMessage))
+               break;
+            memcpy(&shard, payload, sizeof(uint32_t));
+            memcpy(&message, payload + sizeof(uint32_t), sizeof(ShardMessage));
+            if (shard < SERVER_MAX_SHARDS && shard != reader->header.shard)
+               handleShardMessage(data, shard, &message);
+            break;
+
+         case JOURNAL_TICK:
+            start = metricsNow();
+            serverTick(data);
+            histogramAdd(&data->metrics.tick, metricsNow() - start);
+            data->metrics.ticks++;
+            replayDrain(data);
+            break;
+      }
+   }
+
+   LOG_I("Replayed %lu records of shard %u in %.3f s.", records, reader->header.shard, (metricsNow() - started) / 1e6);
+   metricsWrite(&data->metrics, (metricsNow() - started) / 1000000, stdout);
+   ret = RETURN_OK;
+
+out:
+   if (data) {
+      deinitEnet(data);
+      pthread_mutex_destroy(&data->metricsLock);
+      free(data);
+   }
+   journalClose(reader);
+   return ret;
+}
+
+static size_t serverMemoryBudget(void)
+{
+   const char *budget;
+   long mib;
+
+   if (!(budget = getenv("SRVBIRTH_MEMORY_BUDGET")) || (mib = atol(budget)) <= 0)
+      mib = SERVER_DEFAULT_MEMORY_BUDGET;
+
+   return (size_t)mib * 1024 * 1024;
+}
+
+/* shard state plus queues each way between every pair of shards */
+static size_t serverMemoryFor(unsigned int numShards, unsigned int queueSize)
+{
+   return numShards * sizeof(ServerData) + (size_t)numShards * (numShards - 1) *
+      (queueSize * sizeof(ShardState) + SHARD_CONTROL_QUEUE_SIZE * sizeof(ShardMessage));
+}
+
+static unsigned int serverWorkerCount(size_t budget)
+{
+   const char *workers;
+   long count, wanted;
+
+   if (!(workers = getenv("SRVBIRTH_WORKERS")) || (count = atoi(workers)) <= 0)
+      count = sysconf(_SC_NPROCESSORS_ONLN);
+
+   if (count < 1) count = 1;
+   if (count > SERVER_MAX_SHARDS) count = SERVER_MAX_SHARDS;
+
+   for (wanted = count; count > 1 && serverMemoryFor(count, SHARD_QUEUE_MIN) > budget; --count);
+   if (count != wanted)
+      LOG_W("Memory budget of %zu MiB fits %ld worker(s), not %ld.", budget / (1024 * 1024), count, wanted);
+
+   return count;
+}
+
+static unsigned int serverQueueSize(unsigned int numShards, size_t budget)
+{
+   unsigned int size = SHARD_QUEUE_SIZE;
+   while (size > SHARD_QUEUE_MIN && serverMemoryFor(numShards, size) > budget)
+      size /= 2;
+   return size;
+}
+
 int main(int argc, char **argv)
 {
-   /* global data */
-   ServerData data;
-   initServerData(&data);
+   unsigned int i, j, numShards, queueSize;
+   size_t budget;
+   int ret = EXIT_FAILURE, signals = -1, epoll = -1, count, running = 1;
+   sigset_t mask;
+   struct signalfd_siginfo info;
+   struct epoll_event ev, events[3];
+   ServerStats stats;
+   Queue *queue;
+
+   /* global data, one per worker */
+   ServerData *shards[SERVER_MAX_SHARDS];
+   memset(shards, 0, sizeof(shards));
+   stats.socket = stats.timer = -1;
 
-   if (initEnet(NULL, 1234, &data) != RETURN_OK)
+   /* block before any thread is started, so the logger and the
+    * workers inherit the mask and signals are only read here */
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
       return EXIT_FAILURE;
 
-   while (1) {
-      manageEnet(&data);
+   logInit();
+   if (enet_initialize() != 0) {
+      LOG_E("An error occurred while initializing ENet.");
+      logDeinit();
+      return EXIT_FAILURE;
+   }
+
+   /* server --replay <journal> [--realtime] */
+   if (argc >= 3 && !strcmp(argv[1], "--replay")) {
+      /* nothing to clean up on a signal, keep the default action */
+      pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+      if (serverReplay(argv[2], argc >= 4 && !strcmp(argv[3], "--realtime")) == RETURN_OK)
+         ret = EXIT_SUCCESS;
+      enet_deinitialize();
+      logDeinit();
+      return ret;
+   }
+
+   budget = serverMemoryBudget();
+   numShards = serverWorkerCount(budget);
+   queueSize = serverQueueSize(numShards, budget);
+   for (i = 0; i != numShards; ++i) {
+      if (!(shards[i] = malloc(sizeof(ServerData))))
+         goto fail;
+
+      initServerData(shards[i], i, numShards);
+      if (initEnet(NULL, 1234, shards[i]) != RETURN_OK ||
+          initEventLoop(shards[i]) != RETURN_OK ||
+          serverOpenJournal(shards[i]) != RETURN_OK)
+         goto fail;
+   }
+
+   /* one queue for each direction between each pair of shards */
+   for (i = 0; i != numShards; ++i) {
+      for (j = 0; j != numShards; ++j) {
+         if (i == j) continue;
+         if (!(queue = queueNew(queueSize, sizeof(ShardState))))
+            goto fail;
+
+         shards[i]->outbox[j] = queue;
+         shards[j]->inbox[i] = queue;
+
+         if (!(queue = queueNew(SHARD_CONTROL_QUEUE_SIZE, sizeof(ShardMessage))))
+            goto fail;
+
+         shards[i]->controlOut[j] = queue;
+         shards[j]->controlIn[i] = queue;
+      }
+   }
+
+   if ((signals = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+      LOG_E("Failed to set up signal handling.");
+      goto fail;
+   }
+
+   /* main thread only waits for signals and stats requests */
+   if ((epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      goto fail;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = signals;
+   if (epoll_ctl(epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0)
+      goto fail;
+
+   /* serve without stats rather than not at all */
+   if (initStats(&stats) != RETURN_OK)
+      LOG_W("Stats are not available.");
+
+   ev.data.fd = stats.socket;
+   if (stats.socket >= 0) epoll_ctl(epoll, EPOLL_CTL_ADD, ev.data.fd, &ev);
+   ev.data.fd = stats.timer;
+   if (stats.timer >= 0) epoll_ctl(epoll, EPOLL_CTL_ADD, ev.data.fd, &ev);
+
+   LOG_I("Serving on port 1234 with %u worker(s).", numShards);
+   for (i = 0; i != numShards; ++i) {
+      if (pthread_create(&shards[i]->thread, NULL, serverWorker, shards[i]) != 0) {
+         /* workers already running use the shards, don't free under them */
+         LOG_E("Failed to start worker %u.", i);
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   while (running) {
+      if ((count = epoll_wait(epoll, events, 3, -1)) < 0) {
+         if (errno == EINTR) continue;
+         break;
+      }
+
+      for (i = 0; i < (unsigned int)count; ++i) {
+         if (events[i].data.fd == signals) {
+            if (read(signals, &info, sizeof(info)) == sizeof(info))
+               running = 0;
+         } else if (events[i].data.fd == stats.socket) {
+            serverServeStats(&stats, shards, numShards);
+         } else {
+            serverDumpStats(&stats, shards, numShards);
+         }
+      }
    }
+   LOG_I("Shutting down.");
+
+   for (i = 0; i != numShards; ++i)
+      serverStop(shards[i]);
 
-   deinitEnet(&data);
-   return EXIT_SUCCESS;
+   for (i = 0; i != numShards; ++i)
+      pthread_join(shards[i]->thread, NULL);
+
+   ret = EXIT_SUCCESS;
+
+fail:
+   if (epoll >= 0) close(epoll);
+   if (signals >= 0) close(signals);
+   deinitStats(&stats);
+   for (i = 0; i != numShards; ++i) {
+      if (!shards[i]) continue;
+      pthread_mutex_destroy(&shards[i]->metricsLock);
+      deinitEventLoop(shards[i]);
+      deinitEnet(shards[i]);
+      if (shards[i]->journal) journalFree(shards[i]->journal);
+      for (j = 0; j != numShards; ++j) {
+         if (shards[i]->outbox[j]) queueFree(shards[i]->outbox[j]);
+         if (shards[i]->controlOut[j]) queueFree(shards[i]->controlOut[j]);
+      }
+      free(shards[i]);
+   }
+   enet_deinitialize();
+   logDeinit();
+   return ret;
 }
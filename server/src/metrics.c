@@ -0,0 +1,150 @@
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "metrics.h"
+
+static const char *packetNames[PACKET_ID_LAST + 1] = {
+   [PACKET_ID_ROSTER] = "roster",
+   [PACKET_ID_ACTOR_STATE] = "actor_state",
+   [PACKET_ID_ACTOR_FULL_STATE] = "actor_full_state",
+   [PACKET_ID_SNAPSHOT] = "snapshot",
+   [PACKET_ID_SNAPSHOT_ACK] = "snapshot_ack",
+   [PACKET_ID_ACTOR_CORRECTION] = "actor_correction",
+   [PACKET_ID_LAST] = "unknown",
+};
+
+unsigned long metricsNow(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+unsigned long metricsNowNsec(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void histogramAdd(Histogram *histogram, unsigned long value)
+{
+   unsigned int b = 0;
+   assert(histogram);
+
+   /* bucket b holds values below 2^b */
+   for (; b < METRICS_BUCKETS - 1 && (value >> b); ++b);
+   histogram->bucket[b]++;
+   histogram->count++;
+   histogram->sum += value;
+   if (value > histogram->max) histogram->max = value;
+}
+
+static unsigned int packetIndex(unsigned char id)
+{
+   if (id >= PACKET_ID_LAST || !packetNames[id])
+      return PACKET_ID_LAST;
+   return id;
+}
+
+void metricsPacketIn(Metrics *metrics, const unsigned char *data, size_t size)
+{
+   const unsigned int i = (size ? packetIndex(data[0]) : PACKET_ID_LAST);
+   metrics->packetsIn[i]++;
+   metrics->bytesIn[i] += size;
+}
+
+/* server packets lead with the client id, so the caller passes the id */
+void metricsPacketOut(Metrics *metrics, unsigned char id, size_t size)
+{
+   const unsigned int i = packetIndex(id);
+   metrics->packetsOut[i]++;
+   metrics->bytesOut[i] += size;
+}
+
+static void histogramMerge(Histogram *into, const Histogram *from)
+{
+   unsigned int b;
+   into->count += from->count;
+   into->sum += from->sum;
+   if (from->max > into->max) into->max = from->max;
+   for (b = 0; b != METRICS_BUCKETS; ++b)
+      into->bucket[b] += from->bucket[b];
+}
+
+void metricsMerge(Metrics *into, const Metrics *from)
+{
+   unsigned int i;
+   assert(into && from);
+
+   for (i = 0; i <= PACKET_ID_LAST; ++i) {
+      into->packetsIn[i] += from->packetsIn[i];
+      into->bytesIn[i] += from->bytesIn[i];
+      into->packetsOut[i] += from->packetsOut[i];
+      into->bytesOut[i] += from->bytesOut[i];
+   }
+
+   into->ticks += from->ticks;
+   into->skippedTicks += from->skippedTicks;
+   into->deferredEntries += from->deferredEntries;
+   into->shardDeferred += from->shardDeferred;
+   histogramMerge(&into->tick, &from->tick);
+   histogramMerge(&into->join, &from->join);
+   for (i = 0; i != PACKET_ID_LAST; ++i)
+      histogramMerge(&into->handler[i], &from->handler[i]);
+
+   for (i = 0; i != from->numPeers && into->numPeers < METRICS_MAX_PEERS; ++i)
+      memcpy(&into->peers[into->numPeers++], &from->peers[i], sizeof(PeerMetrics));
+}
+
+static void histogramWrite(const char *name, const char *unit, const Histogram *histogram, FILE *out)
+{
+   unsigned int b;
+   if (!histogram->count)
+      return;
+
+   fprintf(out, "histogram %s count=%lu mean_%s=%lu max_%s=%lu", name, histogram->count,
+         unit, histogram->sum / histogram->count, unit, histogram->max);
+   for (b = 0; b != METRICS_BUCKETS; ++b) {
+      if (!histogram->bucket[b]) continue;
+      if (b == METRICS_BUCKETS - 1) fprintf(out, " inf:%lu", histogram->bucket[b]);
+      else fprintf(out, " <%lu:%lu", 1UL << b, histogram->bucket[b]);
+   }
+   fputc('\n', out);
+}
+
+void metricsWrite(const Metrics *metrics, unsigned long uptime, FILE *out)
+{
+   unsigned int i;
+   char name[64];
+   assert(metrics && out);
+
+   fprintf(out, "uptime_s %lu\n", uptime);
+   fprintf(out, "ticks %lu\n", metrics->ticks);
+   fprintf(out, "ticks_skipped %lu\n", metrics->skippedTicks);
+   fprintf(out, "snapshot_entries_deferred %lu\n", metrics->deferredEntries);
+   fprintf(out, "shard_messages_deferred %lu\n", metrics->shardDeferred);
+
+   for (i = 0; i <= PACKET_ID_LAST; ++i) {
+      if (!metrics->packetsIn[i] && !metrics->packetsOut[i]) continue;
+      fprintf(out, "packets %s in=%lu in_bytes=%lu out=%lu out_bytes=%lu\n", packetNames[i],
+            metrics->packetsIn[i], metrics->bytesIn[i], metrics->packetsOut[i], metrics->bytesOut[i]);
+   }
+
+   histogramWrite("tick", "us", &metrics->tick, out);
+   histogramWrite("join", "us", &metrics->join, out);
+   for (i = 0; i != PACKET_ID_LAST; ++i) {
+      if (!packetNames[i]) continue;
+      snprintf(name, sizeof(name), "handler_%s", packetNames[i]);
+      histogramWrite(name, "ns", &metrics->handler[i], out);
+   }
+
+   fprintf(out, "peers %u\n", metrics->numPeers);
+   for (i = 0; i != metrics->numPeers; ++i) {
+      fprintf(out, "peer %u shard=%u rtt_ms=%u rtt_var_ms=%u loss=%u\n", metrics->peers[i].clientId,
+            metrics->peers[i].shard, metrics->peers[i].roundTripTime,
+            metrics->peers[i].roundTripTimeVariance, metrics->peers[i].packetLoss);
+   }
+}
+
+/* vim: set ts=8 sw=3 tw=0 :*/
@@ -0,0 +1,67 @@
+#ifndef SRVBIRTH_METRICS_H
+#define SRVBIRTH_METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "../common/types.h"
+
+/* histogram buckets are powers of two in microseconds,
+ * nanoseconds for the packet handlers,
+ * the last one collects everything above */
+#define METRICS_BUCKETS 24
+
+/* peers reported per shard */
+#define METRICS_MAX_PEERS 256
+
+typedef struct Histogram {
+   unsigned long count;
+   unsigned long sum; /* microseconds, nanoseconds for handlers */
+   unsigned long max;
+   unsigned long bucket[METRICS_BUCKETS];
+} Histogram;
+
+typedef struct PeerMetrics {
+   unsigned int clientId;
+   unsigned int shard;
+   unsigned int roundTripTime; /* milliseconds */
+   unsigned int roundTripTimeVariance;
+   unsigned int packetLoss; /* ENET_PEER_PACKET_LOSS_SCALE is 100% */
+} PeerMetrics;
+
+/* Counters of one shard. The worker writes its own copy
+ * without locking and publishes it periodically. */
+typedef struct Metrics {
+   unsigned long packetsIn[PACKET_ID_LAST + 1]; /* last is unknown ids */
+   unsigned long bytesIn[PACKET_ID_LAST + 1];
+   unsigned long packetsOut[PACKET_ID_LAST + 1];
+   unsigned long bytesOut[PACKET_ID_LAST + 1];
+   unsigned long ticks;
+   unsigned long skippedTicks;
+   unsigned long deferredEntries; /* snapshot entries over a peer's budget */
+   unsigned long shardDeferred; /* messages to other shards left for a later tick, queue was full */
+   Histogram tick;
+   Histogram join;
+   Histogram handler[PACKET_ID_LAST]; /* nanoseconds */
+   unsigned int numPeers;
+   PeerMetrics peers[METRICS_MAX_PEERS];
+} Metrics;
+
+/* monotonic clock in microseconds */
+unsigned long metricsNow(void);
+
+/* same clock in nanoseconds, for what is over in a few microseconds */
+unsigned long metricsNowNsec(void);
+
+void histogramAdd(Histogram *histogram, unsigned long value);
+void metricsPacketIn(Metrics *metrics, const unsigned char *data, size_t size);
+void metricsPacketOut(Metrics *metrics, unsigned char id, size_t size);
+
+/* add counters of from to into, peers are appended while they fit */
+void metricsMerge(Metrics *into, const Metrics *from);
+
+/* human readable report */
+void metricsWrite(const Metrics *metrics, unsigned long uptime, FILE *out);
+
+#endif /* SRVBIRTH_METRICS_H */
+
+/* vim: set ts=8 sw=3 tw=0 :*/